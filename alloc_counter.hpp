@@ -0,0 +1,44 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+// Counts calls to the global operator new when built with -DALLOC_COUNTS, for
+// the allocation columns of --bench. The replacement operators are ordinary
+// (non-inline) definitions, so this header must be included by exactly one
+// translation unit. Without the flag the counts stay at zero.
+
+struct AllocCounts {
+    uint64_t allocs;
+    uint64_t bytes;
+};
+
+inline atomic<uint64_t> _alloc_calls{0};
+inline atomic<uint64_t> _alloc_bytes{0};
+
+inline AllocCounts alloc_counts() {
+    return AllocCounts{_alloc_calls.load(memory_order_relaxed), _alloc_bytes.load(memory_order_relaxed)};
+}
+
+#ifdef ALLOC_COUNTS
+// kept out of line: once inlined into a caller, GCC pairs the caller's new
+// expression with the free below and reports -Wmismatched-new-delete
+__attribute__((noinline)) void* operator new(size_t size) {
+    _alloc_calls.fetch_add(1, memory_order_relaxed);
+    _alloc_bytes.fetch_add(size, memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+#endif
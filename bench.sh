@@ -0,0 +1,84 @@
+#!/bin/bash
+# Reproducible benchmark: counts, trains, serializes, encodes and decodes the
+# bundled corpora plus a generated synthetic one, and records one JSON line
+# per corpus and phase (wall time, MB/s, merges/s, allocations, peak RSS).
+# Every corpus runs BENCH_RUNS times and the fastest run of each phase is
+# kept. The results are written to BENCH_OUT and compared against the
+# baseline: a phase whose time or allocation count grew by more than
+# BENCH_TOLERANCE (a fraction) is flagged and the script exits non-zero.
+# Every run uses BENCH_THREADS threads (1 by default), since the count and
+# encode phases allocate per thread; allocation counts then compare across
+# machines, while timings from another machine do not: refresh the baseline
+# with `make bench-baseline` first.
+# usage: ./bench.sh [binary] [baseline]
+BIN=${1:-./bytepair-bench}
+BASELINE=${2:-bench_baseline.jsonl}
+OUT=${BENCH_OUT:-bench_results.jsonl}
+RUNS=${BENCH_RUNS:-5}
+TOLERANCE=${BENCH_TOLERANCE:-0.25}
+BACKEND=${BENCH_BACKEND:-bucket}
+THREADS=${BENCH_THREADS:-1}
+SYNTHETIC_BYTES=${BENCH_SYNTHETIC_BYTES:-1000000}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+"$BIN" --synthetic "$TMP/synthetic.txt" "$SYNTHETIC_BYTES" || exit 1
+for f in quixote.txt jeeves.txt "$TMP/synthetic.txt"; do
+    for run in $(seq "$RUNS"); do
+        "$BIN" --bench --backend "$BACKEND" --threads "$THREADS" "$f" "$TMP/out.bpe" >> "$TMP/runs.jsonl" || exit 1
+    done
+done
+
+# keeps the fastest line of every corpus/phase, in first-seen order
+awk -F'"phase":"' '{
+    split($2, rest, "\"")
+    match($0, /"corpus":"[^"]*"/)
+    key = substr($0, RSTART, RLENGTH) rest[1]
+    match($0, /"seconds":[^,]*/)
+    seconds = substr($0, RSTART + 10, RLENGTH - 10) + 0
+    if (!(key in best)) order[n++] = key
+    if (!(key in best) || seconds < best[key]) { best[key] = seconds; line[key] = $0 }
+} END {
+    for (i = 0; i < n; i++) print line[order[i]]
+}' "$TMP/runs.jsonl" > "$OUT"
+
+# reads the flat JSON lines of both files and compares them by corpus/phase
+BASE=$([ -f "$BASELINE" ] && echo "$BASELINE" || echo /dev/null)
+awk -v tolerance="$TOLERANCE" -v base="$BASE" '
+function field(name,    v) {
+    if (!match($0, "\"" name "\":\"?[^,\"}]*")) return ""
+    v = substr($0, RSTART + length(name) + 3, RLENGTH - length(name) - 3)
+    sub(/^"/, "", v)
+    return v
+}
+FILENAME == base {
+    key = field("corpus") "/" field("phase")
+    base_seconds[key] = field("seconds")
+    base_allocs[key] = field("allocs")
+    next
+}
+FNR == 1 {
+    printf "%-28s %10s %10s %8s %12s %12s %8s  %s\n", "corpus/phase", "seconds", "base", "change", "allocs", "base", "change", "status"
+}
+{
+    key = field("corpus") "/" field("phase")
+    status = "ok"
+    if (!(key in base_seconds)) {
+        printf "%-28s %10.4f %10s %8s %12d %12s %8s  %s\n", key, field("seconds"), "-", "-", field("allocs"), "-", "-", "new"
+        next
+    }
+    dt = base_seconds[key] > 0 ? field("seconds") / base_seconds[key] - 1 : 0
+    da = base_allocs[key] > 0 ? field("allocs") / base_allocs[key] - 1 : 0
+    # phases under 5 ms are too short for their time to mean anything
+    if (dt > tolerance && field("seconds") - base_seconds[key] > 0.005) status = "SLOWER"
+    if (da > tolerance) status = (status == "ok" ? "" : status ",") "MORE-ALLOCS"
+    if (status != "ok") regressions++
+    printf "%-28s %10.4f %10.4f %+7.1f%% %12d %12d %+7.1f%%  %s\n", key, field("seconds"), base_seconds[key], dt * 100,
+        field("allocs"), base_allocs[key], da * 100, status
+}
+END {
+    if (regressions) {
+        printf "%d regression(s) beyond %.0f%%\n", regressions, tolerance * 100
+        exit 1
+    }
+}' "$BASE" "$OUT"
@@ -0,0 +1,26 @@
+#!/bin/bash
+# Trains with every frequency table backend on the bundled corpora, one
+# process per run so peak RSS is per backend, and prints merges/s, peak RSS
+# and heap operation counts. The counts are only reported by a binary built
+# with -DHEAP_OP_COUNTS (as bytepair-bench is) and show as 0 otherwise.
+# usage: ./bench_backends.sh [binary] [backend...]
+BIN=${1:-./bytepair-bench}
+shift
+BACKENDS=${@:-bucket binary fib pairing}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# the Shakespeare corpus only ships as a trained model; expand it back
+"$BIN" --unpack shakie.bpe "$TMP/shakespeare.txt" > /dev/null || exit 1
+
+printf "%-16s %-8s %8s %9s %11s %12s %10s %10s %12s %12s\n" \
+    corpus backend merges seconds merges/s peak_rss_kb pushes updates erases moves
+for f in quixote.txt jeeves.txt "$TMP/shakespeare.txt"; do
+    for b in $BACKENDS; do
+        "$BIN" --backend "$b" --print-every 1000000000 "$f" "$TMP/out.bpe" | grep '^backend ' | \
+            awk -v corpus="$(basename "$f")" '{
+                printf "%-16s %-8s %8d %9.3f %11.0f %12d %10d %10d %12d %12d\n",
+                    corpus, $2, $4, $6, $8, $10, $12, $14, $16, $18
+            }'
+    done
+done
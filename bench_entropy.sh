@@ -0,0 +1,33 @@
+#!/bin/bash
+# Compares BPE alone and BPE + entropy coding against general purpose
+# compressors on the bundled corpora: compressed size and decode time.
+# usage: ./bench_entropy.sh [binary] [corpus...]
+BIN=${1:-./bytepair-release}
+shift
+CORPORA=${@:-quixote.txt jeeves.txt}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+TIMEFORMAT=%R
+
+# prints the wall time in seconds of the command
+seconds() {
+    { time "$@" > /dev/null 2>&1; } 2>&1
+}
+
+printf "%-12s %-10s %10s %8s %10s\n" corpus method bytes ratio decode_s
+for f in $CORPORA; do
+    raw=$(stat -c %s "$f")
+    row() {
+        printf "%-12s %-10s %10d %8.3f %10s\n" "$f" "$1" "$2" "$(awk "BEGIN { print $2 / $raw }")" "$3"
+    }
+    for c in "gzip -9" "zstd -19" "xz -9"; do
+        name=${c%% *}
+        $c -c "$f" > "$TMP/$name"
+        row "$name" "$(stat -c %s "$TMP/$name")" "$(seconds $name -dc "$TMP/$name")"
+    done
+    "$BIN" --entropy "$TMP/bpz" "$f" "$TMP/bpe" > /dev/null
+    row bpe "$(stat -c %s "$TMP/bpe")" "$(seconds "$BIN" --unpack "$TMP/bpe" "$TMP/out")"
+    cmp -s "$f" "$TMP/out" || echo "bpe round trip failed for $f"
+    row bpe+huff "$(stat -c %s "$TMP/bpz")" "$(seconds "$BIN" --unpack "$TMP/bpz" "$TMP/out")"
+    cmp -s "$f" "$TMP/out" || echo "bpz round trip failed for $f"
+done
@@ -0,0 +1,79 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+
+// smallest width that can hold every value below count (at least 1 bit)
+inline uint32_t bit_width_for(uint64_t count) {
+    uint32_t width = 1;
+    while (width < 64 && (count - 1) >> width) width++;
+    return width;
+}
+
+inline uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0) {
+    static const array<uint32_t, 256> table = [] {
+        array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Appends fixed-width values of up to 32 bits, least significant bit first.
+class BitWriter {
+private:
+    vector<uint8_t>& out_;
+    uint64_t acc_;
+    uint32_t bits_;
+
+public:
+    BitWriter(vector<uint8_t>& out) : out_(out), acc_(0), bits_(0) {}
+
+    void write(uint32_t value, uint32_t width) {
+        acc_ |= (uint64_t)value << bits_;
+        bits_ += width;
+        while (bits_ >= 8) {
+            out_.push_back(acc_ & 0xFF);
+            acc_ >>= 8;
+            bits_ -= 8;
+        }
+    }
+
+    // pads the last partial byte with zeros
+    void flush() {
+        if (bits_ > 0) out_.push_back(acc_ & 0xFF);
+        acc_ = 0;
+        bits_ = 0;
+    }
+};
+
+// Random access to fixed-width values written by BitWriter. Each read loads
+// one unaligned 64-bit word, so the buffer needs 8 readable bytes past the
+// last value (see PADDING).
+class BitReader {
+private:
+    const uint8_t* data_;
+    uint32_t width_;
+    uint64_t mask_;
+
+public:
+    static constexpr size_t PADDING = 8;
+
+    BitReader(const uint8_t* data, uint32_t width) : data_(data), width_(width), mask_((1ull << width) - 1) {}
+
+    uint32_t get(uint64_t index) const {
+        uint64_t bit = index * width_;
+        uint64_t word;
+        memcpy(&word, data_ + (bit >> 3), sizeof(word));
+        return (word >> (bit & 7)) & mask_;
+    }
+};
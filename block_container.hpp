@@ -0,0 +1,244 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "bitpack.hpp"
+#include "bpe_decoder.hpp"
+#include "bpe_format.hpp"
+#include "bpe_types.hpp"
+#include "mapped_file.hpp"
+
+using namespace std;
+
+// Random-access container (bpeb0.01) for serving byte ranges of a compressed
+// corpus. The token stream is cut into blocks of about block_size expanded
+// bytes, and a block index maps each block to its first byte and first token,
+// so read(offset, len) only decodes the blocks the range touches:
+//
+//   BlockHeader | grammar payload | BlockEntry index[block_count + 1]
+//   | token payload | 8 zero bytes
+//
+// Tokens are bit-packed at a fixed width like bpe0.02. Any block therefore
+// starts at bit token_offset * width and decodes without the ones before it.
+// The grammar is shared by every block. The last index entry is a sentinel
+// holding the totals, and each entry carries the CRC-32 of the bytes its
+// block's tokens occupy.
+
+#define BLOCK_DEFAULT_SIZE (1 << 16)
+
+struct BlockHeader {
+    char magic[8];          // "bpeb0.01"
+    uint32_t width;         // bits per token and per rule half
+    uint32_t reserved;
+    uint64_t block_size;    // target expanded bytes per block
+    uint64_t block_count;
+    uint64_t token_count;
+    uint64_t grammar_size;  // including the terminals
+    uint64_t grammar_bytes;
+    uint64_t index_offset;
+    uint64_t tokens_offset;
+    uint32_t grammar_crc;
+    uint32_t header_crc;    // over every field above, with index CRCs folded in
+};
+static_assert(sizeof(BlockHeader) == 80, "BlockHeader must not have padding");
+
+struct BlockEntry {
+    uint64_t byte_offset;   // first expanded byte of the block
+    uint64_t token_offset;  // first token of the block
+    uint32_t crc;           // of the token payload bytes holding the block
+    uint32_t reserved;
+};
+
+inline uint64_t _block_payload_begin(uint64_t token, uint32_t width) {
+    return token * width / 8;
+}
+
+inline uint64_t _block_payload_end(uint64_t token, uint32_t width) {
+    return (token * width + 7) / 8;
+}
+
+// Writes bpe (grammar and tokens) as a block container. Blocks end on the
+// first token boundary at or past block_size expanded bytes.
+inline bool write_blocks(const string& fname, const BPEFile& bpe, uint64_t block_size = BLOCK_DEFAULT_SIZE) {
+    ExpansionTable expansions(bpe.grammar);
+    BlockHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "bpeb0.01", 8);
+    header.width = bit_width_for(max<size_t>(bpe.grammar.size(), 256));
+    header.block_size = max<uint64_t>(block_size, 1);
+    header.token_count = bpe.tokens.size();
+    header.grammar_size = bpe.grammar.size();
+
+    vector<uint8_t> grammar;
+    BitWriter gw(grammar);
+    for (size_t i = 256; i < bpe.grammar.size(); i++) {
+        gw.write(bpe.grammar[i].l, header.width);
+        gw.write(bpe.grammar[i].r, header.width);
+    }
+    gw.flush();
+    vector<uint8_t> tokens;
+    BitWriter tw(tokens);
+    for (Token t : bpe.tokens) tw.write(t, header.width);
+    tw.flush();
+
+    vector<BlockEntry> index;
+    uint64_t bytes = 0;
+    for (uint64_t i = 0; i < bpe.tokens.size(); i++) {
+        if (index.empty() || bytes - index.back().byte_offset >= header.block_size) {
+            index.push_back(BlockEntry{bytes, i, 0, 0});
+        }
+        bytes += expansions.length[bpe.tokens[i]];
+    }
+    header.block_count = index.size();
+    index.push_back(BlockEntry{bytes, bpe.tokens.size(), 0, 0});
+    for (size_t b = 0; b + 1 < index.size(); b++) {
+        uint64_t begin = _block_payload_begin(index[b].token_offset, header.width);
+        uint64_t end = _block_payload_end(index[b + 1].token_offset, header.width);
+        index[b].crc = crc32(tokens.data() + begin, end - begin);
+    }
+
+    header.grammar_bytes = grammar.size();
+    header.index_offset = (sizeof(header) + grammar.size() + 7) & ~7ull;
+    header.tokens_offset = header.index_offset + index.size() * sizeof(BlockEntry);
+    header.grammar_crc = crc32(grammar.data(), grammar.size());
+    uint32_t crc = crc32(reinterpret_cast<const uint8_t*>(&header), offsetof(BlockHeader, header_crc));
+    header.header_crc = crc32(reinterpret_cast<const uint8_t*>(index.data()), index.size() * sizeof(BlockEntry), crc);
+
+    ofstream file(fname, ios::binary);
+    if (!file) {
+        cerr << "Error opening file: " << fname << endl;
+        return false;
+    }
+    const char zeros[8] = {0};
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(grammar.data()), grammar.size());
+    file.write(zeros, header.index_offset - sizeof(header) - grammar.size());
+    file.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(BlockEntry));
+    file.write(reinterpret_cast<const char*>(tokens.data()), tokens.size());
+    file.write(zeros, BitReader::PADDING);
+    if (!file) {
+        cerr << "Error writing file: " << fname << endl;
+        return false;
+    }
+    return true;
+}
+
+// Serves byte ranges of a block container. The file is mapped, the grammar
+// is expanded once on open, and every read decodes whole blocks straight out
+// of the mapping.
+class BlockReader {
+private:
+    MappedFile file_;
+    const BlockHeader* header_;
+    const BlockEntry* index_;
+    const uint8_t* tokens_;
+    vector<Pair> grammar_;
+    ExpansionTable table_;
+
+public:
+    explicit BlockReader(const string& fname) : file_(fname, MADV_RANDOM), header_(nullptr) {
+        if (!file_.data()) return;
+        const BlockHeader* header = reinterpret_cast<const BlockHeader*>(file_.data());
+        if (file_.size() < sizeof(BlockHeader) || memcmp(header->magic, "bpeb0.01", 8) != 0) {
+            cerr << "Unsupported block file: " << fname << endl;
+            return;
+        }
+        size_t rules = header->grammar_size > 256 ? header->grammar_size - 256 : 0;
+        uint64_t token_bytes = (header->token_count * header->width + 7) / 8;
+        if (header->width == 0 || header->width > 32
+                || header->grammar_bytes != (rules * 2 * header->width + 7) / 8
+                || header->index_offset != ((sizeof(BlockHeader) + header->grammar_bytes + 7) & ~7ull)
+                || header->tokens_offset != header->index_offset + (header->block_count + 1) * sizeof(BlockEntry)
+                || header->tokens_offset + token_bytes + BitReader::PADDING != file_.size()) {
+            cerr << "Corrupt header in " << fname << endl;
+            return;
+        }
+        const uint8_t* base = file_.data();
+        const BlockEntry* index = reinterpret_cast<const BlockEntry*>(base + header->index_offset);
+        uint32_t crc = crc32(base, offsetof(BlockHeader, header_crc));
+        crc = crc32(reinterpret_cast<const uint8_t*>(index), (header->block_count + 1) * sizeof(BlockEntry), crc);
+        if (crc != header->header_crc || crc32(base + sizeof(BlockHeader), header->grammar_bytes) != header->grammar_crc
+                || index[header->block_count].token_offset != header->token_count) {
+            cerr << "Checksum mismatch in " << fname << endl;
+            return;
+        }
+
+        grammar_.resize(header->grammar_size);
+        for (Token i = 0; i < 256 && i < header->grammar_size; i++) {
+            grammar_[i] = Pair{i, 0};
+        }
+        BitReader gr(base + sizeof(BlockHeader), header->width);
+        for (size_t i = 0; i < rules; i++) {
+            grammar_[256 + i] = Pair{gr.get(2 * i), gr.get(2 * i + 1)};
+        }
+        try {
+            table_ = ExpansionTable(grammar_);
+        } catch (const invalid_argument& e) {
+            cerr << "Invalid grammar in " << fname << ": " << e.what() << endl;
+            return;
+        }
+        header_ = header;
+        index_ = index;
+        tokens_ = base + header->tokens_offset;
+    }
+
+    bool ok() const {
+        return header_ != nullptr;
+    }
+
+    // expanded size of the whole corpus
+    uint64_t size() const {
+        return index_[header_->block_count].byte_offset;
+    }
+
+    uint64_t blocks() const {
+        return header_->block_count;
+    }
+
+    const vector<Pair>& grammar() const {
+        return grammar_;
+    }
+
+    // Appends bytes [offset, offset + len) of the corpus to out, clipped to its
+    // end. Throws runtime_error if a touched block fails its checksum.
+    void read(uint64_t offset, uint64_t len, vector<uint8_t>& out) const {
+        uint64_t end = min(size(), offset + len);
+        if (offset >= end) return;
+        // last block starting at or before offset
+        const BlockEntry* first = upper_bound(index_, index_ + header_->block_count, offset,
+            [](uint64_t value, const BlockEntry& entry) { return value < entry.byte_offset; }) - 1;
+        BitReader tr(tokens_, header_->width);
+        out.reserve(out.size() + (end - offset));
+        uint64_t pos = first->byte_offset;
+        for (const BlockEntry* block = first; pos < end; block++) {
+            uint64_t begin_byte = _block_payload_begin(block->token_offset, header_->width);
+            uint64_t end_byte = _block_payload_end(block[1].token_offset, header_->width);
+            if (crc32(tokens_ + begin_byte, end_byte - begin_byte) != block->crc) {
+                throw runtime_error("Block checksum mismatch");
+            }
+            for (uint64_t i = block->token_offset; i < block[1].token_offset && pos < end; i++) {
+                Token t = tr.get(i);
+                if (t >= table_.size()) throw runtime_error("Token is not in the grammar");
+                uint64_t length = table_.length[t];
+                if (pos + length > offset) {
+                    uint64_t skip = offset > pos ? offset - pos : 0;
+                    uint64_t take = min(length, end - pos) - skip;
+                    const uint8_t* src = table_.data(t) + skip;
+                    out.insert(out.end(), src, src + take);
+                }
+                pos += length;
+            }
+        }
+    }
+
+    vector<uint8_t> read(uint64_t offset, uint64_t len) const {
+        vector<uint8_t> out;
+        read(offset, len, out);
+        return out;
+    }
+};
@@ -0,0 +1,174 @@
+#pragma once
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include "bpe_types.hpp"
+#include "expansion_table.hpp"
+
+using namespace std;
+
+#define DECODE_COPY 16 // bytes per fixed-size copy, and per slot of an owned table
+
+// Allocator that default-initializes, so resizing a ByteBuffer leaves the new
+// bytes uninitialized instead of zero-filling memory that is overwritten next.
+template <typename T>
+struct DefaultInitAllocator : allocator<T> {
+    template <typename U>
+    struct rebind {
+        typedef DefaultInitAllocator<U> other;
+    };
+
+    DefaultInitAllocator() = default;
+    template <typename U>
+    DefaultInitAllocator(const DefaultInitAllocator<U>&) {}
+
+    template <typename U>
+    void construct(U* p) {
+        ::new (static_cast<void*>(p)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+};
+
+typedef vector<uint8_t, DefaultInitAllocator<uint8_t>> ByteBuffer;
+
+// thrown by BPE_Decoder for a token outside the grammar, or one whose
+// expansion lies outside a damaged borrowed table; index counts tokens from
+// the start of the decode call or stream
+struct BadToken : out_of_range {
+    Token token;
+    size_t index;
+
+    BadToken(Token token, size_t index, const char* what = "is not in the grammar")
+        : out_of_range(what), token(token), index(index) {}
+};
+
+// Turns token streams back into bytes out of a flattened ExpansionTable, so no
+// recursion or per-token allocation is left on the read path. Decoding is a
+// single pass: the output is sized for DECODE_COPY bytes per token up front
+// and grows geometrically past that, without being zero-filled (pages that
+// are never written are never touched), and a short expansion is copied as a
+// whole DECODE_COPY block whose excess the next token overwrites, so the
+// per-token copy is one unaligned load and store. The table is either built
+// from a grammar and owned, or borrowed from storage that outlives the
+// decoder (a mapped VocabImage). An owned table also gets a slot per token
+// holding its expansion inline with the length in the last byte, so most
+// tokens cost one random access instead of three (offset, length, bytes).
+class BPE_Decoder {
+private:
+    struct Slot {
+        uint8_t bytes[DECODE_COPY]; // expansion, then SLOT_LONG or the length in the last byte
+    };
+    static constexpr uint8_t SLOT_LONG = 0xff;
+
+    const uint64_t* offset_;
+    const uint32_t* length_;
+    const uint8_t* bytes_;
+    uint64_t bytes_size_;
+    size_t size_;
+    vector<Slot> slots_; // empty when the arrays are borrowed
+
+    // writes the expansion of t to dst, which has DECODE_COPY bytes of room past it, and returns its length
+    size_t _copy(Token t, uint8_t* dst) const {
+        uint32_t length = length_[t];
+        if (length <= DECODE_COPY && offset_[t] + DECODE_COPY <= bytes_size_) {
+            memcpy(dst, bytes_ + offset_[t], DECODE_COPY);
+        } else {
+            memcpy(dst, bytes_ + offset_[t], length);
+        }
+        return length;
+    }
+
+public:
+    ExpansionTable table; // empty when the arrays are borrowed
+
+    explicit BPE_Decoder(const vector<Pair>& grammar) : table(grammar) {
+        offset_ = table.offset.data();
+        length_ = table.length.data();
+        bytes_ = table.bytes.data();
+        bytes_size_ = table.bytes.size();
+        size_ = table.size();
+        slots_.resize(size_);
+        for (size_t t = 0; t < size_; t++) {
+            Slot& slot = slots_[t];
+            memset(slot.bytes, 0, DECODE_COPY);
+            if (length_[t] < DECODE_COPY) {
+                memcpy(slot.bytes, bytes_ + offset_[t], length_[t]);
+                slot.bytes[DECODE_COPY - 1] = length_[t];
+            } else {
+                slot.bytes[DECODE_COPY - 1] = SLOT_LONG;
+            }
+        }
+    }
+
+    BPE_Decoder(const uint64_t* offset, const uint32_t* length, const uint8_t* bytes, uint64_t bytes_size, size_t size)
+        : offset_(offset), length_(length), bytes_(bytes), bytes_size_(bytes_size), size_(size) {}
+
+    BPE_Decoder(const BPE_Decoder&) = delete;
+    BPE_Decoder& operator=(const BPE_Decoder&) = delete;
+
+    // appends the bytes of tokens[0 .. count) to out; out is left as it was
+    // and BadToken thrown if a token is not in the grammar
+    template <typename Buffer>
+    void decode(const Token* tokens, size_t count, Buffer& out) const {
+        size_t start = out.size();
+        size_t pos = start;
+        out.resize(pos + count * DECODE_COPY + DECODE_COPY);
+        for (size_t i = 0; i < count; i++) {
+            Token t = tokens[i];
+            if (t >= size_) {
+                out.resize(start);
+                throw BadToken(t, i);
+            }
+            if (!slots_.empty() && slots_[t].bytes[DECODE_COPY - 1] != SLOT_LONG) {
+                // an expansion is never longer than DECODE_COPY - 1 here, so the room is already there
+                memcpy(out.data() + pos, slots_[t].bytes, DECODE_COPY);
+                pos += slots_[t].bytes[DECODE_COPY - 1];
+            } else {
+                if (offset_[t] > bytes_size_ || length_[t] > bytes_size_ - offset_[t]) {
+                    out.resize(start);
+                    throw BadToken(t, i, "has an expansion outside the table");
+                }
+                if (pos + length_[t] + DECODE_COPY > out.size()) {
+                    out.resize(max(out.size() * 2, pos + length_[t] + DECODE_COPY));
+                }
+                pos += _copy(t, out.data() + pos);
+            }
+            if (pos + DECODE_COPY > out.size()) out.resize(out.size() * 2);
+        }
+        out.resize(pos);
+    }
+
+    ByteBuffer decode(const vector<Token>& tokens) const {
+        ByteBuffer out;
+        decode(tokens.data(), tokens.size(), out);
+        return out;
+    }
+
+    // Decodes a raw uint32 token stream from in to out, buffer_tokens at a
+    // time, so neither side has to fit in memory. Returns the bytes written.
+    size_t decode_stream(istream& in, ostream& out, size_t buffer_tokens = 1 << 16) const {
+        vector<Token> tokens(buffer_tokens);
+        ByteBuffer bytes;
+        size_t written = 0, done = 0;
+        while (in) {
+            in.read(reinterpret_cast<char*>(tokens.data()), tokens.size() * sizeof(Token));
+            size_t count = in.gcount() / sizeof(Token);
+            if (count == 0) break;
+            bytes.clear();
+            try {
+                decode(tokens.data(), count, bytes);
+            } catch (const BadToken& e) {
+                throw BadToken(e.token, done + e.index, e.what());
+            }
+            done += count;
+            out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+            written += bytes.size();
+        }
+        return written;
+    }
+};
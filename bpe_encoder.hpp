@@ -0,0 +1,258 @@
+#pragma once
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bpe_types.hpp"
+#include "flat_hash_map.hpp"
+#include "pretokenize.hpp"
+
+using namespace std;
+
+#define ENCODE_PIECE (1 << 14) // bytes, pieces are cut at the first safe point after this
+#define ENCODE_MIN_CHUNK (1 << 16) // bytes per thread
+#define JUNCTION_WORDS (65536 / 64) // uint64_t words in a rule_junctions bitmap
+
+// Min-queue of 64-bit keys for the case where nothing smaller than the last
+// popped key is ever pushed (a radix heap). Key k sits in bucket
+// bit_width(k ^ last), so bucket 0 holds keys equal to last and a key only
+// moves to lower buckets, at most 64 times; push and pop are amortized
+// constant time and touch a few contiguous arrays.
+class MonotoneQueue {
+private:
+    vector<uint64_t> buckets_[65];
+    uint64_t last_;
+    size_t size_;
+
+    static unsigned _bucket(uint64_t x) {
+        return x ? 64 - __builtin_clzll(x) : 0;
+    }
+
+public:
+    MonotoneQueue() : last_(0), size_(0) {}
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    // empties the queue and accepts any key again; keeps the buckets' storage
+    void clear() {
+        for (auto& bucket : buckets_) bucket.clear();
+        last_ = 0;
+        size_ = 0;
+    }
+
+    void push(uint64_t key) {
+        buckets_[_bucket(key ^ last_)].push_back(key);
+        size_++;
+    }
+
+    uint64_t pop() {
+        if (buckets_[0].empty()) {
+            unsigned b = 1;
+            while (buckets_[b].empty()) b++;
+            vector<uint64_t>& from = buckets_[b];
+            last_ = *min_element(from.begin(), from.end());
+            for (uint64_t key : from) buckets_[_bucket(key ^ last_)].push_back(key);
+            from.clear();
+        }
+        size_--;
+        uint64_t key = buckets_[0].back();
+        buckets_[0].pop_back();
+        return key;
+    }
+};
+
+// Working storage of merge_by_rank, kept across calls so that encoding many
+// pieces does not allocate for each one.
+struct MergeScratch {
+    // everything a merge touches about a position, in one place
+    struct Node {
+        Token token;
+        Token rank; // of the pair starting here, NO_RANK if none or merged away
+        uint32_t prev, next;
+    };
+    vector<Node> nodes;
+    MonotoneQueue queue; // rank << 32 | position
+};
+
+// Replays the merges of a grammar over data and appends the tokens to out.
+// Rule ids above the 256 terminals are also merge ranks, so replaying the
+// merges in training order is the same as repeatedly merging the adjacent pair
+// with the lowest rank. The candidates are keyed by (rank, position), which
+// keeps equal-rank merges left to right like the trainer. A rule only refers
+// to earlier ids, so every pair a merge creates outranks the merge itself and
+// the candidates fit a MonotoneQueue. Each position caches the rank of the
+// pair it starts, so stale candidates are dropped without looking the pair up
+// again. Ranks is anything with rank(Pair) and NO_RANK. With a segment start
+// bitmap (see pretokenize.hpp), where data begins at bit base, no pair is
+// merged across the start of a segment.
+template <typename Ranks>
+void merge_by_rank(const Ranks& ranks, const unsigned char* data, size_t size, vector<Token>& out,
+    MergeScratch& scratch, const vector<uint64_t>* starts = nullptr, size_t base = 0) {
+    constexpr uint32_t npos = UINT32_MAX;
+    constexpr Token NO_RANK = Ranks::NO_RANK;
+    auto joinable = [&](uint32_t right) {
+        return !starts || !segment_start(*starts, base + right);
+    };
+    if (size == 0) return;
+
+    typedef MergeScratch::Node Node;
+    vector<Node>& nodes = scratch.nodes;
+    MonotoneQueue& queue = scratch.queue;
+    nodes.resize(size);
+    queue.clear();
+    for (size_t i = 0; i < size; i++) {
+        Token r = i + 1 < size && joinable(i + 1) ? ranks.rank(Pair{data[i], data[i + 1]}) : NO_RANK;
+        nodes[i] = Node{data[i], r, i > 0 ? (uint32_t)i - 1 : npos, i + 1 < size ? (uint32_t)i + 1 : npos};
+        if (r != NO_RANK) queue.push((uint64_t)r << 32 | i);
+    }
+
+    while (!queue.empty()) {
+        uint64_t key = queue.pop();
+        Token r = key >> 32;
+        uint32_t i = (uint32_t)key;
+        // stale if either side has been merged since the candidate was queued
+        Node& node = nodes[i];
+        if (node.rank != r) continue;
+
+        Node& right = nodes[node.next];
+        node.token = r;
+        right.rank = NO_RANK;
+        node.next = right.next;
+        if (node.next != npos) nodes[node.next].prev = i;
+
+        if (node.prev != npos && joinable(i)) {
+            Token lr = ranks.rank(Pair{nodes[node.prev].token, r});
+            nodes[node.prev].rank = lr;
+            if (lr != NO_RANK) queue.push((uint64_t)lr << 32 | node.prev);
+        }
+        node.rank = NO_RANK;
+        if (node.next != npos && joinable(node.next)) {
+            node.rank = ranks.rank(Pair{r, nodes[node.next].token});
+            if (node.rank != NO_RANK) queue.push((uint64_t)node.rank << 32 | i);
+        }
+    }
+
+    for (uint32_t i = 0; i != npos; i = nodes[i].next) {
+        out.push_back(nodes[i].token);
+    }
+}
+
+// Bitmap over byte pairs: bit a << 8 | b is set when some rule joins a token
+// ending in byte a to a token starting with b. Every pair of adjacent bytes
+// inside a token's expansion is such a junction, so no merge can ever cross
+// between two bytes whose bit is clear.
+inline void rule_junctions(const Pair* grammar, size_t size, vector<uint64_t>& junctions) {
+    junctions.assign(JUNCTION_WORDS, 0);
+    vector<uint8_t> first(size), last(size);
+    for (size_t t = 0; t < size; t++) {
+        if (t < 256) {
+            first[t] = last[t] = t;
+            continue;
+        }
+        Pair p = grammar[t];
+        if (p.l >= t || p.r >= t) { // not a valid grammar, so cut nowhere
+            junctions.assign(JUNCTION_WORDS, ~0ull);
+            return;
+        }
+        first[t] = first[p.l];
+        last[t] = last[p.r];
+        unsigned j = last[p.l] << 8 | first[p.r];
+        junctions[j >> 6] |= 1ull << (j & 63);
+    }
+}
+
+// Encodes data with merge_by_rank one piece at a time. The text is cut
+// between bytes that no rule joins (see rule_junctions), and at segment
+// starts when segmented, into pieces of about ENCODE_PIECE bytes. No merge
+// crosses a cut, so the pieces give the same tokens as the whole text would,
+// while each one keeps its working set in cache. Runs of pieces are spread
+// over threads.
+template <typename Ranks>
+void encode_pieces(const Ranks& ranks, const uint64_t* junctions, const unsigned char* data, size_t size,
+    vector<Token>& out, bool segmented, unsigned threads) {
+    vector<uint64_t> starts;
+    if (segmented) segment_starts(data, size, starts);
+    // first cut at or after p
+    auto cut = [&](size_t p) {
+        for (p = max<size_t>(p, 1); p < size; p++) {
+            unsigned j = data[p - 1] << 8 | data[p];
+            if (!((junctions[j >> 6] >> (j & 63)) & 1) || (segmented && segment_start(starts, p))) return p;
+        }
+        return size;
+    };
+    // encodes data[lo .. hi), where hi is a cut
+    auto run = [&](size_t lo, size_t hi, vector<Token>& part) {
+        MergeScratch scratch;
+        while (lo < hi) {
+            size_t end = lo + ENCODE_PIECE < hi ? cut(lo + ENCODE_PIECE) : hi;
+            merge_by_rank(ranks, data + lo, end - lo, part, scratch, segmented ? &starts : nullptr, lo);
+            lo = end;
+        }
+    };
+
+    size_t chunks = max<size_t>(1, min<size_t>(threads, size / ENCODE_MIN_CHUNK));
+    vector<size_t> bounds(chunks + 1, size);
+    bounds[0] = 0;
+    for (size_t t = 1; t < chunks; t++) {
+        bounds[t] = cut(max(bounds[t - 1], size * t / chunks));
+    }
+    vector<vector<Token>> parts(chunks);
+    vector<thread> workers;
+    for (size_t t = 1; t < chunks; t++) {
+        workers.emplace_back([&, t] { run(bounds[t], bounds[t + 1], parts[t]); });
+    }
+    run(0, bounds[1], out);
+    for (auto& w : workers) w.join();
+    for (size_t t = 1; t < chunks; t++) {
+        out.insert(out.end(), parts[t].begin(), parts[t].end());
+    }
+}
+
+// Tokenizes new text with a trained grammar, looking ranks up in a hash map
+// built from it (see encode_pieces and merge_by_rank). Pairs of two bytes,
+// which is every pair merge_by_rank starts from, are answered from a flat
+// 64K table instead. A segmented encoder
+// pre-tokenizes the text like a grammar trained with BPE_FLAG_SEGMENTED.
+class BPE_Encoder {
+private:
+    FlatHashMap<Pair, Token, PairHash> ranks_;
+    vector<Token> byte_ranks_; // rank of byte pair l << 8 | r
+    vector<uint64_t> junctions_;
+    bool segmented_;
+    unsigned threads_;
+
+public:
+    static constexpr Token NO_RANK = UINT32_MAX;
+    vector<Pair> grammar;
+
+    BPE_Encoder(const vector<Pair>& grammar, bool segmented = false, unsigned threads = 0)
+        : segmented_(segmented), threads_(threads ? threads : max(1u, thread::hardware_concurrency())),
+          grammar(grammar) {
+        ranks_.reserve(grammar.size());
+        byte_ranks_.assign(65536, NO_RANK);
+        for (Token i = 256; i < grammar.size(); i++) {
+            if (ranks_.count(grammar[i])) continue;
+            ranks_[grammar[i]] = i;
+            if (grammar[i].l < 256 && grammar[i].r < 256) byte_ranks_[grammar[i].l << 8 | grammar[i].r] = i;
+        }
+        rule_junctions(grammar.data(), grammar.size(), junctions_);
+    }
+
+    Token rank(Pair pair) const {
+        if ((pair.l | pair.r) < 256) return byte_ranks_[pair.l << 8 | pair.r];
+        auto it = ranks_.find(pair);
+        return it == ranks_.end() ? NO_RANK : it->second;
+    }
+
+    void encode(const unsigned char* data, size_t size, vector<Token>& out) const {
+        encode_pieces(*this, junctions_.data(), data, size, out, segmented_, threads_);
+    }
+
+    vector<Token> encode(const string& input) const {
+        vector<Token> out;
+        encode(reinterpret_cast<const unsigned char*>(input.data()), input.size(), out);
+        return out;
+    }
+};
@@ -0,0 +1,243 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "bitpack.hpp"
+#include "bpe_types.hpp"
+
+using namespace std;
+
+// On-disk layout of a trained encoding, version bpe0.02:
+//
+//   BPEHeader | token payload | grammar payload
+//
+// Both payloads hold fixed-width values of header.width bits, the smallest
+// width that fits every rule id. The token payload is the compressed token
+// stream. The grammar payload is (l, r) for every rule from 256 on, since
+// the 256 terminal rules are implied (BPE_FLAG_IMPLICIT_TERMINALS). Each
+// payload and the header carry a CRC-32. BPE_FLAG_SEGMENTED marks grammars
+// trained with pre-tokenization (see pretokenize.hpp), which must be encoded
+// the same way. BPE_FLAG_GRAMMAR_ONLY marks files whose token stream was not
+// kept (the streaming trainer's), which cannot be unpacked.
+//
+// read_bpe also accepts the older bpe0.01 files: raw 4-byte tokens and
+// 8-byte sizes.
+
+#define BPE_FLAG_IMPLICIT_TERMINALS 1u
+#define BPE_FLAG_SEGMENTED 2u
+#define BPE_FLAG_GRAMMAR_ONLY 4u
+
+struct BPEHeader {
+    char magic[8];          // "bpe0.02\0"
+    uint32_t flags;
+    uint32_t width;         // bits per stored value
+    uint64_t iterations;
+    uint64_t token_count;
+    uint64_t grammar_size;  // including the terminals
+    uint64_t token_bytes;
+    uint64_t grammar_bytes;
+    uint32_t token_crc;
+    uint32_t grammar_crc;
+    uint32_t header_crc;    // over every field above
+    uint32_t reserved;
+};
+static_assert(sizeof(BPEHeader) == 72, "BPEHeader must not have padding");
+
+struct BPEFile {
+    uint32_t flags = 0;
+    uint64_t iterations = 0;
+    vector<Token> tokens;
+    vector<Pair> grammar;
+};
+
+inline bool write_bpe(ostream& os, const BPEFile& bpe) {
+    BPEHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "bpe0.02", 8);
+    header.flags = bpe.flags | BPE_FLAG_IMPLICIT_TERMINALS;
+    header.width = bit_width_for(max<size_t>(bpe.grammar.size(), 256));
+    header.iterations = bpe.iterations;
+    header.token_count = bpe.tokens.size();
+    header.grammar_size = bpe.grammar.size();
+
+    vector<uint8_t> tokens, grammar;
+    BitWriter tw(tokens);
+    for (Token t : bpe.tokens) tw.write(t, header.width);
+    tw.flush();
+    BitWriter gw(grammar);
+    for (size_t i = 256; i < bpe.grammar.size(); i++) {
+        gw.write(bpe.grammar[i].l, header.width);
+        gw.write(bpe.grammar[i].r, header.width);
+    }
+    gw.flush();
+
+    header.token_bytes = tokens.size();
+    header.grammar_bytes = grammar.size();
+    header.token_crc = crc32(tokens.data(), tokens.size());
+    header.grammar_crc = crc32(grammar.data(), grammar.size());
+    header.header_crc = crc32(reinterpret_cast<const uint8_t*>(&header), offsetof(BPEHeader, header_crc));
+
+    os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    os.write(reinterpret_cast<const char*>(tokens.data()), tokens.size());
+    os.write(reinterpret_cast<const char*>(grammar.data()), grammar.size());
+    return bool(os);
+}
+
+inline bool write_bpe(const string& fname, const BPEFile& bpe) {
+    ofstream file(fname, ios::binary);
+    if (!file) {
+        cerr << "Error opening file: " << fname << endl;
+        return false;
+    }
+    if (!write_bpe(file, bpe)) {
+        cerr << "Error writing file: " << fname << endl;
+        return false;
+    }
+    return true;
+}
+
+// index of the first rule that refers to itself or a later rule, SIZE_MAX if none
+inline size_t _bad_rule(const vector<Pair>& grammar) {
+    for (size_t i = 256; i < grammar.size(); i++) {
+        if (grammar[i].l >= i || grammar[i].r >= i) return i;
+    }
+    return SIZE_MAX;
+}
+
+// index of the first token outside the grammar, SIZE_MAX if none
+inline size_t _bad_token(const vector<Token>& tokens, size_t grammar_size) {
+    for (size_t i = 0; i < tokens.size(); i++) {
+        if (tokens[i] >= grammar_size) return i;
+    }
+    return SIZE_MAX;
+}
+
+inline bool _read_bpe_legacy(const vector<uint8_t>& buffer, size_t size, BPEFile& bpe, bool with_tokens) {
+    size_t pos = 7;
+    auto take = [&](void* dst, size_t n) {
+        if (pos + n > size) return false;
+        memcpy(dst, buffer.data() + pos, n);
+        pos += n;
+        return true;
+    };
+    uint64_t iterations, count;
+    if (!take(&iterations, sizeof(iterations)) || !take(&count, sizeof(count))) return false;
+    if (count > (size - pos) / sizeof(Token)) return false;
+    if (with_tokens) {
+        bpe.tokens.resize(count);
+        take(bpe.tokens.data(), count * sizeof(Token));
+    } else {
+        pos += count * sizeof(Token);
+    }
+    if (!take(&count, sizeof(count)) || count > (size - pos) / sizeof(Pair)) return false;
+    bpe.grammar.resize(count);
+    take(bpe.grammar.data(), count * sizeof(Pair));
+    bpe.iterations = iterations;
+    bpe.flags = 0;
+    return true;
+}
+
+// Loads a .bpe file with a single read. The token stream is skipped unless
+// with_tokens is set, which is all an encoder or decoder needs.
+inline bool read_bpe(const string& fname, BPEFile& bpe, bool with_tokens = true) {
+    ifstream file(fname, ios::binary | ios::ate);
+    if (!file) {
+        cerr << "Error opening file: " << fname << endl;
+        return false;
+    }
+    size_t size = file.tellg();
+    file.seekg(0);
+    vector<uint8_t> buffer(size + BitReader::PADDING, 0);
+    if (!file.read(reinterpret_cast<char*>(buffer.data()), size)) {
+        cerr << "Error reading file: " << fname << endl;
+        return false;
+    }
+
+    if (size >= 7 && memcmp(buffer.data(), "bpe0.01", 7) == 0) {
+        if (!_read_bpe_legacy(buffer, size, bpe, with_tokens)) {
+            cerr << "Truncated file: " << fname << endl;
+            return false;
+        }
+        size_t bad = _bad_rule(bpe.grammar);
+        if (bad != SIZE_MAX) {
+            cerr << "Invalid rule " << bad << " in " << fname << endl;
+            return false;
+        }
+        bad = _bad_token(bpe.tokens, bpe.grammar.size());
+        if (bad != SIZE_MAX) {
+            cerr << "Invalid token at position " << bad << " in " << fname << endl;
+            return false;
+        }
+        return true;
+    }
+
+    BPEHeader header;
+    if (size < sizeof(header) || memcmp(buffer.data(), "bpe0.02", 8) != 0) {
+        cerr << "Unsupported version in " << fname << endl;
+        return false;
+    }
+    memcpy(&header, buffer.data(), sizeof(header));
+    const uint8_t* tokens = buffer.data() + sizeof(header);
+    const uint8_t* grammar = tokens + header.token_bytes;
+    size_t rules = header.grammar_size > 256 ? header.grammar_size - 256 : 0;
+    // the counts are bounded by the payload sizes, and those by the file size,
+    // before anything is multiplied or added, so a crafted header cannot wrap
+    if (header.header_crc != crc32(buffer.data(), offsetof(BPEHeader, header_crc))
+            || header.width == 0 || header.width > 32
+            || header.token_bytes > size || header.grammar_bytes > size
+            || header.token_count > header.token_bytes * 8 / header.width
+            || rules > header.grammar_bytes * 8 / (2 * header.width)
+            || header.token_bytes != (header.token_count * header.width + 7) / 8
+            || header.grammar_bytes != (rules * 2 * header.width + 7) / 8
+            || sizeof(header) + header.token_bytes + header.grammar_bytes != size
+            || !(header.flags & BPE_FLAG_IMPLICIT_TERMINALS)) {
+        cerr << "Corrupt header in " << fname << endl;
+        return false;
+    }
+    if (crc32(grammar, header.grammar_bytes) != header.grammar_crc
+            || (with_tokens && crc32(tokens, header.token_bytes) != header.token_crc)) {
+        cerr << "Checksum mismatch in " << fname << endl;
+        return false;
+    }
+
+    bpe.flags = header.flags;
+    bpe.iterations = header.iterations;
+    bpe.grammar.resize(header.grammar_size);
+    for (Token i = 0; i < 256 && i < header.grammar_size; i++) {
+        bpe.grammar[i] = Pair{i, 0};
+    }
+    BitReader gr(grammar, header.width);
+    for (size_t i = 0; i < rules; i++) {
+        bpe.grammar[256 + i] = Pair{gr.get(2 * i), gr.get(2 * i + 1)};
+        if (bpe.grammar[256 + i].l >= 256 + i || bpe.grammar[256 + i].r >= 256 + i) {
+            cerr << "Invalid rule " << 256 + i << " in " << fname << endl;
+            return false;
+        }
+    }
+    bpe.tokens.clear();
+    if (with_tokens) {
+        bpe.tokens.resize(header.token_count);
+        BitReader tr(tokens, header.width);
+        for (size_t i = 0; i < header.token_count; i++) {
+            bpe.tokens[i] = tr.get(i);
+        }
+        size_t bad = _bad_token(bpe.tokens, bpe.grammar.size());
+        if (bad != SIZE_MAX) {
+            cerr << "Invalid token at position " << bad << " in " << fname << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool read_grammar(const string& fname, vector<Pair>& grammar) {
+    BPEFile bpe;
+    if (!read_bpe(fname, bpe, false)) return false;
+    grammar = std::move(bpe.grammar);
+    return true;
+}
@@ -0,0 +1,261 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "bitpack.hpp"
+#include "bpe_format.hpp"
+#include "bpe_types.hpp"
+#include "expansion_table.hpp"
+#include "pretokenize.hpp"
+
+using namespace std;
+
+// Greedy longest-match tokenizer over the expanded vocabulary: every rule of
+// the grammar is spelled out as bytes and inserted into a byte trie, and the
+// input is segmented in one left to right pass taking the longest vocabulary
+// entry at each position. This is not always the segmentation merge replay
+// (BPE_Encoder) produces, but it never needs a heap and has no rank lookups.
+// A trie built for a grammar trained with BPE_FLAG_SEGMENTED keeps the flag
+// and never lets a match run past the start of a segment.
+//
+// After building, the trie is flattened into arrays: node k owns the edges
+// edge_begin[k] .. edge_begin[k + 1] - 1, sorted by label. The same arrays are
+// what save() writes and load() reads back, after a TrieHeader:
+//
+//   TrieHeader | node_token[nodes] | edge_begin[nodes + 1] | edge_label[edges] | edge_target[edges]
+//
+// data_crc covers the four arrays and header_crc the header. load() also
+// checks that the arrays form a trie over the grammar before using them.
+
+struct TrieHeader {
+    char magic[8];          // "bpetrie2"
+    uint32_t flags;         // BPE_FLAG_SEGMENTED or 0
+    uint32_t reserved;
+    uint64_t nodes;
+    uint64_t edges;
+    uint64_t grammar_size;  // every token in the trie is below this
+    uint32_t data_crc;
+    uint32_t header_crc;    // over every field above
+};
+static_assert(sizeof(TrieHeader) == 48, "TrieHeader must not have padding");
+
+class BPE_Trie {
+public:
+    static constexpr Token NO_TOKEN = UINT32_MAX;
+
+private:
+    vector<Token> node_token_;     // token spelled by the path to the node, or NO_TOKEN
+    vector<uint32_t> edge_begin_;  // size nodes + 1
+    vector<uint8_t> edge_label_;
+    vector<uint32_t> edge_target_;
+    uint32_t root_next_[256];      // dense first level, 0 when absent (root is node 0)
+    uint64_t grammar_size_;
+    bool segmented_;
+
+    uint32_t _child(uint32_t node, uint8_t c) const {
+        auto first = edge_label_.begin() + edge_begin_[node];
+        auto last = edge_label_.begin() + edge_begin_[node + 1];
+        auto it = lower_bound(first, last, c);
+        if (it == last || *it != c) return 0;
+        return edge_target_[it - edge_label_.begin()];
+    }
+
+    void _index_root() {
+        fill(begin(root_next_), end(root_next_), 0);
+        for (uint32_t e = edge_begin_[0]; e < edge_begin_[1]; e++) {
+            root_next_[edge_label_[e]] = edge_target_[e];
+        }
+    }
+
+public:
+    BPE_Trie() : grammar_size_(0), segmented_(false) {
+        fill(begin(root_next_), end(root_next_), 0);
+    }
+
+    explicit BPE_Trie(const vector<Pair>& grammar, bool segmented = false) {
+        build(grammar, segmented);
+    }
+
+    void build(const vector<Pair>& grammar, bool segmented = false) {
+        ExpansionTable expansions(grammar);
+        grammar_size_ = grammar.size();
+        segmented_ = segmented;
+
+        // build-time trie with per-node edge lists; lowest id wins on equal spellings
+        struct BuildNode {
+            Token token;
+            vector<pair<uint8_t, uint32_t>> children;
+        };
+        vector<BuildNode> nodes(1, BuildNode{NO_TOKEN, {}});
+        for (Token t = 0; t < expansions.size(); t++) {
+            uint32_t node = 0;
+            for (uint32_t k = 0; k < expansions.length[t]; k++) {
+                uint8_t c = expansions.data(t)[k];
+                auto& children = nodes[node].children;
+                auto it = find_if(children.begin(), children.end(), [c](const auto& e) { return e.first == c; });
+                if (it != children.end()) {
+                    node = it->second;
+                } else {
+                    uint32_t child = nodes.size();
+                    nodes[node].children.push_back({c, child});
+                    nodes.push_back(BuildNode{NO_TOKEN, {}});
+                    node = child;
+                }
+            }
+            if (nodes[node].token == NO_TOKEN) nodes[node].token = t;
+        }
+
+        node_token_.resize(nodes.size());
+        edge_begin_.assign(1, 0);
+        edge_label_.clear();
+        edge_target_.clear();
+        for (uint32_t k = 0; k < nodes.size(); k++) {
+            node_token_[k] = nodes[k].token;
+            sort(nodes[k].children.begin(), nodes[k].children.end());
+            for (const auto& [label, target] : nodes[k].children) {
+                edge_label_.push_back(label);
+                edge_target_.push_back(target);
+            }
+            edge_begin_.push_back(edge_label_.size());
+        }
+        _index_root();
+    }
+
+    size_t nodes() const {
+        return node_token_.size();
+    }
+
+    void encode(const unsigned char* data, size_t size, vector<Token>& out) const {
+        vector<uint64_t> starts;
+        if (segmented_) segment_starts(data, size, starts);
+        size_t i = 0;
+        while (i < size) {
+            Token best = NO_TOKEN;
+            size_t best_len = 0;
+            uint32_t node = root_next_[data[i]];
+            size_t j = i + 1;
+            while (node) {
+                if (node_token_[node] != NO_TOKEN) {
+                    best = node_token_[node];
+                    best_len = j - i;
+                }
+                if (j == size || (segmented_ && segment_start(starts, j))) break;
+                node = _child(node, data[j++]);
+            }
+            if (best == NO_TOKEN) { // only possible for a grammar without terminals
+                best = data[i];
+                best_len = 1;
+            }
+            out.push_back(best);
+            i += best_len;
+        }
+    }
+
+    vector<Token> encode(const string& input) const {
+        vector<Token> out;
+        encode(reinterpret_cast<const unsigned char*>(input.data()), input.size(), out);
+        return out;
+    }
+
+    bool save(const string& fname) const {
+        ofstream file(fname, ios::binary);
+        if (!file) {
+            cerr << "Error opening file: " << fname << endl;
+            return false;
+        }
+        TrieHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "bpetrie2", 8);
+        header.nodes = node_token_.size();
+        header.edges = edge_label_.size();
+        header.grammar_size = grammar_size_;
+        header.flags = segmented_ ? BPE_FLAG_SEGMENTED : 0;
+        uint32_t crc = crc32(reinterpret_cast<const uint8_t*>(node_token_.data()), node_token_.size() * sizeof(Token));
+        crc = crc32(reinterpret_cast<const uint8_t*>(edge_begin_.data()), edge_begin_.size() * sizeof(uint32_t), crc);
+        crc = crc32(edge_label_.data(), edge_label_.size(), crc);
+        header.data_crc = crc32(reinterpret_cast<const uint8_t*>(edge_target_.data()), edge_target_.size() * sizeof(uint32_t), crc);
+        header.header_crc = crc32(reinterpret_cast<const uint8_t*>(&header), offsetof(TrieHeader, header_crc));
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(node_token_.data()), node_token_.size() * sizeof(Token));
+        file.write(reinterpret_cast<const char*>(edge_begin_.data()), edge_begin_.size() * sizeof(uint32_t));
+        file.write(reinterpret_cast<const char*>(edge_label_.data()), edge_label_.size());
+        file.write(reinterpret_cast<const char*>(edge_target_.data()), edge_target_.size() * sizeof(uint32_t));
+        if (!file) {
+            cerr << "Error writing file: " << fname << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Loads a trie written by save(). Fails unless the checksums match and
+    // every edge range, edge target and token is in range, so a damaged file
+    // can never be read out of bounds.
+    bool load(const string& fname) {
+        ifstream file(fname, ios::binary | ios::ate);
+        if (!file) {
+            cerr << "Error opening file: " << fname << endl;
+            return false;
+        }
+        size_t size = file.tellg();
+        file.seekg(0);
+        vector<uint8_t> buffer(size);
+        if (!file.read(reinterpret_cast<char*>(buffer.data()), size)) {
+            cerr << "Error reading file: " << fname << endl;
+            return false;
+        }
+
+        TrieHeader header;
+        if (size < sizeof(header) || memcmp(buffer.data(), "bpetrie2", 8) != 0) {
+            cerr << "Unsupported trie file: " << fname << endl;
+            return false;
+        }
+        memcpy(&header, buffer.data(), sizeof(header));
+        // counts are bounded first so that the size computation cannot overflow
+        if (header.header_crc != crc32(buffer.data(), offsetof(TrieHeader, header_crc))
+                || (header.flags & ~BPE_FLAG_SEGMENTED)
+                || header.nodes == 0 || header.nodes >= UINT32_MAX || header.edges >= UINT32_MAX
+                || header.grammar_size > NO_TOKEN
+                || sizeof(header) + header.nodes * 8 + 4 + header.edges * 5 != size) {
+            cerr << "Corrupt header in " << fname << endl;
+            return false;
+        }
+        if (crc32(buffer.data() + sizeof(header), size - sizeof(header)) != header.data_crc) {
+            cerr << "Checksum mismatch in " << fname << endl;
+            return false;
+        }
+
+        const uint8_t* p = buffer.data() + sizeof(header);
+        auto take = [&p](auto& v, size_t count) {
+            v.resize(count);
+            memcpy(v.data(), p, count * sizeof(v[0]));
+            p += count * sizeof(v[0]);
+        };
+        take(node_token_, header.nodes);
+        take(edge_begin_, header.nodes + 1);
+        take(edge_label_, header.edges);
+        take(edge_target_, header.edges);
+        grammar_size_ = header.grammar_size;
+        segmented_ = header.flags & BPE_FLAG_SEGMENTED;
+
+        bool ok = edge_begin_[0] == 0 && edge_begin_[header.nodes] == header.edges;
+        for (size_t k = 0; ok && k < header.nodes; k++) {
+            ok = edge_begin_[k] <= edge_begin_[k + 1] && edge_begin_[k + 1] <= header.edges
+                && (node_token_[k] == NO_TOKEN || node_token_[k] < grammar_size_);
+            for (uint32_t e = edge_begin_[k]; ok && e < edge_begin_[k + 1]; e++) {
+                ok = edge_target_[e] != 0 && edge_target_[e] < header.nodes
+                    && (e == edge_begin_[k] || edge_label_[e - 1] < edge_label_[e]);
+            }
+        }
+        if (!ok) {
+            cerr << "Corrupt trie in " << fname << endl;
+            *this = BPE_Trie();
+            return false;
+        }
+        _index_root();
+        return true;
+    }
+};
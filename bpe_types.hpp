@@ -0,0 +1,34 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+typedef uint32_t Token;
+
+struct Pair {
+    Token l;
+    Token r;
+
+    bool operator==(const Pair& b) const {
+        return (l == b.l && r == b.r);
+    }
+};
+
+// splitmix64 finalizer; part of the vocab image format, so it must not change
+inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+// mixes both ids into every bit of the hash. The raw bytes of (l, r) put all
+// pairs with the same left id into one slot of a power-of-two table.
+struct PairHash {
+    size_t operator()(const Pair& p) const {
+        return mix64((uint64_t)p.l << 32 | p.r);
+    }
+};
@@ -0,0 +1,202 @@
+#pragma once
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#include "flat_hash_map.hpp"
+#include "heap_ops.hpp"
+
+using namespace std;
+
+// Priority map for integer keys that only move by small steps (pair counts).
+// Every distinct key value owns a bucket holding an intrusive doubly linked
+// list of nodes, so increment, decrement, erase and max are all O(1). max_key_
+// moves up by at most one per increment and otherwise only walks down, which
+// keeps the scan for the next non-empty bucket amortized constant (pushes jump
+// it up by their count, which is paid for by the decrements that created it).
+template <typename K, typename V, typename Hasher, typename HeapKeyFunc>
+class BucketQueueMap {
+private:
+    static constexpr uint32_t NIL = UINT32_MAX;
+
+    struct BucketNode {
+        pair<K, V> data;
+        size_t key;     // bucket this node is linked into
+        uint32_t prev;
+        uint32_t next;
+        bool live;
+    };
+
+    HeapKeyFunc keyFunc_;
+    FlatHashMap<K, uint32_t, Hasher> map_; // key -> slot in nodes_
+    vector<BucketNode> nodes_;
+    vector<uint32_t> free_;     // erased slots available for reuse
+    vector<uint32_t> buckets_;  // head slot of every key bucket
+    size_t max_key_;
+    HeapOpCounts ops_;
+
+    void _link(uint32_t slot, size_t key) {
+        if (key >= buckets_.size()) buckets_.resize(key + 1, NIL);
+        BucketNode& node = nodes_[slot];
+        node.key = key;
+        node.prev = NIL;
+        node.next = buckets_[key];
+        if (node.next != NIL) nodes_[node.next].prev = slot;
+        buckets_[key] = slot;
+        if (key > max_key_) max_key_ = key;
+    }
+
+    // leaves max_key_ alone, which may now point at an empty bucket
+    void _unlink(uint32_t slot) {
+        BucketNode& node = nodes_[slot];
+        if (node.prev != NIL) nodes_[node.prev].next = node.next;
+        else buckets_[node.key] = node.next;
+        if (node.next != NIL) nodes_[node.next].prev = node.prev;
+    }
+
+    // Walks max_key_ down to the highest non-empty bucket. Only called once a
+    // change is complete: relinking the max node first would walk past its
+    // new bucket on every step of a long run of decrements.
+    void _settle_max() {
+        while (max_key_ > 0 && buckets_[max_key_] == NIL) max_key_--;
+    }
+
+public:
+    BucketQueueMap(HeapKeyFunc keyFunc) : keyFunc_(keyFunc), max_key_(0) {
+        buckets_.push_back(NIL);
+    }
+    ~BucketQueueMap() = default;
+
+    void reserve(size_t n) {
+        map_.reserve(n);
+        nodes_.reserve(n);
+    }
+
+    void push(const K& key, const V& value) {
+        if (map_.find(key) != map_.end()) return; // do not add duplicates.
+        HEAP_OP(ops_, pushes);
+        uint32_t slot;
+        if (!free_.empty()) {
+            slot = free_.back();
+            free_.pop_back();
+            nodes_[slot].data = make_pair(key, value);
+        } else {
+            slot = nodes_.size();
+            nodes_.push_back(BucketNode{make_pair(key, value), 0, NIL, NIL, false});
+        }
+        nodes_[slot].live = true;
+        map_[key] = slot;
+        _link(slot, keyFunc_(nodes_[slot].data));
+    }
+
+    template <typename F>
+    const V& update(const K& key, F&& updateFunc) {
+        auto it = map_.find(key);
+        if (it == map_.end()) throw runtime_error("Key not found");
+        HEAP_OP(ops_, updates);
+        uint32_t slot = it->second;
+        updateFunc(nodes_[slot].data.second);
+        size_t new_key = keyFunc_(nodes_[slot].data);
+        if (new_key != nodes_[slot].key) {
+            HEAP_OP(ops_, moves);
+            _unlink(slot);
+            _link(slot, new_key);
+            _settle_max();
+        }
+        return nodes_[slot].data.second;
+    }
+
+    const V& view(const K& key) {
+        auto it = map_.find(key);
+        if (it == map_.end()) throw runtime_error("Key not found");
+        return nodes_[it->second].data.second;
+    }
+
+    pair<K, V> pop() {
+        if (map_.empty()) throw runtime_error("The heap is empty.");
+        return erase(nodes_[buckets_[max_key_]].data.first);
+    }
+
+    const pair<K, V>& max() const {
+        if (map_.empty()) throw runtime_error("The heap is empty.");
+        return nodes_[buckets_[max_key_]].data;
+    }
+
+    // visits entries from the highest key down until f returns false
+    template <typename F>
+    void for_each_descending(F f) const {
+        if (map_.empty()) return;
+        for (size_t key = max_key_ + 1; key-- > 0;) {
+            for (uint32_t slot = buckets_[key]; slot != NIL; slot = nodes_[slot].next) {
+                if (!f(nodes_[slot].data)) return;
+            }
+        }
+    }
+
+    bool contains(K key) const {
+        return map_.find(key) != map_.end();
+    }
+
+    size_t size() const {
+        return map_.size();
+    }
+
+    pair<K, V> erase(K map_key) {
+        auto it = map_.find(map_key);
+        if (it == map_.end()) throw runtime_error("Key not found");
+        HEAP_OP(ops_, erases);
+        uint32_t slot = it->second;
+        map_.erase(it);
+        _unlink(slot);
+        _settle_max();
+        nodes_[slot].live = false;
+        free_.push_back(slot);
+        return std::move(nodes_[slot].data);
+    }
+
+    const HeapOpCounts& ops() const {
+        return ops_;
+    }
+
+    class ConstIterator {
+    public:
+        ConstIterator(const BucketQueueMap& bq, size_t index) : bq_(bq), index_(index) { _skip(); }
+
+        const pair<K, V>& operator*() const {
+            return bq_.nodes_[index_].data;
+        }
+
+        const pair<K, V>* operator->() const {
+            return &bq_.nodes_[index_].data;
+        }
+
+        ConstIterator& operator++() {
+            ++index_;
+            _skip();
+            return *this;
+        }
+
+        bool operator==(const ConstIterator& other) const {
+            return index_ == other.index_;
+        }
+
+        bool operator!=(const ConstIterator& other) const {
+            return index_ != other.index_;
+        }
+
+    private:
+        const BucketQueueMap& bq_;
+        size_t index_;
+
+        void _skip() {
+            while (index_ < bq_.nodes_.size() && !bq_.nodes_[index_].live) ++index_;
+        }
+    };
+
+    ConstIterator begin() const {
+        return ConstIterator(*this, 0);
+    }
+
+    ConstIterator end() const {
+        return ConstIterator(*this, nodes_.size());
+    }
+};
@@ -4,151 +4,455 @@
 #include <vector>
 #include <fstream>
 #include <chrono>
-#include <unordered_set>
 #include <assert.h>
-//#include "heap_map.hpp"
+#include <algorithm>
+#include <thread>
+#include <unordered_set>
+#include <memory>
+#include <sys/resource.h>
+#include <csignal>
+#include "bpe_types.hpp"
+#include "priority_map.hpp"
+#include "heap_map.hpp"
 #include "fib_heap_map.hpp"
-#include "linked_array.hpp"
+#include "pairing_heap_map.hpp"
+#include "bucket_queue_map.hpp"
+#include "flat_linked_array.hpp"
+#include "occurrence_pool.hpp"
+#include "mapped_file.hpp"
+#include "streaming_bpe.hpp"
+#include "bpe_format.hpp"
+#include "bpe_encoder.hpp"
+#include "bpe_trie.hpp"
+#include "bpe_decoder.hpp"
+#include "vocab_image.hpp"
+#include "entropy_coder.hpp"
+#include "block_container.hpp"
+#include "telemetry.hpp"
+#include "alloc_counter.hpp"
+#include "checkpoint.hpp"
+#include "pretokenize.hpp"
 
 using namespace std;
 
-// #define VERBOSE
-#define PRINT_EVERY 1
-
-typedef uint32_t Token;
-
-struct Pair {
-    Token l;
-    Token r;
+#define PRINT_EVERY 1000
+#define TELEMETRY_INTERVAL_MS 1000
+#define CHECKPOINT_EVERY 10000 // merges between checkpoints
+#define BATCH_SCAN_FACTOR 8 // reduce_batch looks at most k * this many candidates
+#define MIN_CHUNK_PER_THREAD (1 << 16) // bytes, below this counting stays on one thread
+#define PARALLEL_MERGE_MIN (1 << 14) // occurrences, below this a merge stays on one thread
 
-    bool operator==(const Pair& b) const {
-        return (l == b.l && r == b.r);
+// runs f(0) .. f(threads - 1) concurrently, f(0) on the calling thread
+template <typename F>
+void parallel_for(unsigned threads, F f) {
+    vector<thread> workers;
+    for (unsigned t = 1; t < threads; t++) {
+        workers.emplace_back(f, t);
     }
-};
-
-struct PairHash {
-    size_t operator()(const Pair& p) const {
-        const size_t* combined = reinterpret_cast<const size_t*>(&p); // could use a union instead
-        return *combined;
+    f(0);
+    for (auto& worker : workers) {
+        worker.join();
     }
-};
+}
 
+// positions live in BPE_Encoding::occurrences and may be stale, count is exact
 struct PairOccurrences {
     Pair pair;
-    unordered_set<Token> occurrences; // compare based on the size of the set
+    uint32_t count; // compare based on the live count
+    uint32_t head;  // position chain in the OccurrencePool
 
     friend ostream& operator<<(ostream& os, const PairOccurrences& p) {
-        os << "(" << p.pair.l << ", " << p.pair.r << ") -> [";
-        for (auto i : p.occurrences) {
-            os << i << " ";
-        }
-        os << "]";
+        os << "(" << p.pair.l << ", " << p.pair.r << ") -> " << p.count;
         return os;
     }
 };
 
-size_t heapKeyFunc(const pair<Pair, PairOccurrences>& p) {
-    return p.second.occurrences.size();
-}
+struct PairCountKey {
+    size_t operator()(const pair<Pair, PairOccurrences>& p) const {
+        return p.second.count;
+    }
+};
 
+// Queue is the pair frequency table, any PriorityMap over pair counts.
+// BucketQueueMap is the fastest; the others are kept to compare against
+// (see bench_backends.sh).
+template <template <typename, typename, typename, typename> class Queue = BucketQueueMap>
+    requires PriorityMap<Queue<Pair, PairOccurrences, PairHash, PairCountKey>, Pair, PairOccurrences>
 class BPE_Encoding {
 private:
+    vector<uint64_t> segment_starts_; // empty unless pre-tokenized, see pretokenize.hpp
+
+    bool _segment_start(uint32_t i) const {
+        return !segment_starts_.empty() && segment_start(segment_starts_, i);
+    }
+
     inline void inc_pair(Pair pair, Token i) {
+        TELEMETRY_ADD(pair_incs, 1);
         if (!freqs.contains(pair)) {
-            freqs.push(pair, PairOccurrences{pair, {i}});
+            freqs.push(pair, PairOccurrences{pair, 1, occurrences.push(OccurrencePool::NIL, i)});
         } else {
             freqs.update(pair, [&](PairOccurrences& po) {
-                cout << "Incrementing pair: " << pair.l << " " << pair.r << " " << i << endl;
-                po.occurrences.insert(i);
+                TRACE("Incrementing pair: " << pair.l << " " << pair.r << " " << i);
+                po.count++;
+                po.head = occurrences.push(po.head, i);
             });
         }
     }
-    inline void dec_pair(Pair pair, Token i) {
+    inline void dec_pair(Pair pair, [[maybe_unused]] Token i) {
         if (!freqs.contains(pair)) {
             throw out_of_range("Pair not found, cannot decrement");
         } else {
-            cout << "Decrement pair: " << pair.l << " " << pair.r << " " << i << endl;
-
-            freqs.update(pair, [&](PairOccurrences& po) {
-                cout << "Im updating..." << endl;
-                po.occurrences.erase(i);
-                cout << "occurrences erased" << endl;
+            TRACE("Decrement pair: " << pair.l << " " << pair.r << " " << i);
+            TELEMETRY_ADD(pair_decs, 1);
+            // the position itself is left in the chain and skipped once stale
+            const PairOccurrences& po = freqs.update(pair, [](PairOccurrences& po) {
+                po.count--;
             });
-            cout << "OUTSIDE OF FUNCTION\n";
-            cout << &freqs.view(pair);
-            if (freqs.view(pair).occurrences.empty()) {
-                cout << "Erasing pair: " << pair.l << " " << pair.r << endl;
-                freqs.erase(pair);
+            if (po.count == 0) {
+                TRACE("Erasing pair: " << pair.l << " " << pair.r);
+                occurrences.release(freqs.erase(pair).second.head);
             }
         }
     }
-public:
-    FibHeapMap<Pair, PairOccurrences, PairHash, function<size_t(const pair<Pair, PairOccurrences>&)>> freqs;
-    //FibHeapMap<Pair, PairOccurrences, PairHash, function<size_t(const PairOccurrences&)>> freqs;
-    Pair most_freq_pair;
-    size_t highest_freq;
-    LinkedArray<Token> tokens_arr;
-    vector<Pair> grammar;
-    size_t iterations;
-    chrono::time_point<std::chrono::system_clock> start;
-    chrono::time_point<std::chrono::system_clock> since_last_print;
 
-    BPE_Encoding(const string& input) : freqs([](const pair<Pair, PairOccurrences>& p) { return p.second.occurrences.size(); }) {
+    template <typename U>
+    void _init(const U* input, size_t size, unsigned threads) {
         since_last_print = chrono::system_clock::now();
         start = chrono::system_clock::now();
-        vector<Token> tokens;
         iterations = 0;
+        batch_rounds = 0;
+        greedy_deviations = 0;
+        greedy_deficit = 0;
         highest_freq = 0;
-        for (const unsigned char& c : input) {
-            tokens.push_back((size_t)c);
-        }
+        most_freq_pair = {0, 0};
 
-        // construct the linked array of tokens
-        tokens_arr.fill(tokens);
+        // construct the linked array of tokens straight from the input
+        tokens_arr.fill(input, size);
 
-        for (Token i = 0; i < 256; i++) {
+        for (Token i = grammar.size(); i < 256; i++) {
             grammar.push_back(Pair{i, 0});
         }
 
-        for (size_t i = 0; i < tokens.size(); i++) {
-            if (i < tokens.size() - 1) {
-                Pair pair = Pair{tokens[i], tokens[i+1]};
-                inc_pair(pair, i);
+        this->threads = threads ? threads : max(1u, thread::hardware_concurrency());
+        count_pairs(this->threads);
+    }
+
+    // Counts every adjacent pair of tokens_arr and bulk loads freqs. Each thread
+    // scans one chunk into a table sharded by pair hash, shard s of all threads is
+    // merged by thread s, and the position chains are filled in parallel too.
+    // Pairs are pushed in order of first occurrence so the result does not
+    // depend on the thread count.
+    void count_pairs(unsigned threads) {
+        typedef unordered_map<Pair, vector<uint32_t>, PairHash> PositionTable;
+        size_t n = tokens_arr.capacity();
+        threads = max<size_t>(1, min<size_t>(threads, n / MIN_CHUNK_PER_THREAD));
+
+        vector<vector<PositionTable>> local(threads, vector<PositionTable>(threads));
+        parallel_for(threads, [&](unsigned t) {
+            size_t lo = n * t / threads;
+            size_t hi = n * (t + 1) / threads;
+            for (size_t i = lo; i < hi; i++) {
+                if (!tokens_arr.exists(i)) continue;
+                uint32_t next = tokens_arr.get_next_index(i);
+                if (next == tokens_arr.npos || _segment_start(next)) continue;
+                Pair pair = Pair{tokens_arr[i], tokens_arr[next]};
+                local[t][PairHash()(pair) % threads][pair].push_back(i);
+            }
+        });
+
+        // chunks are in index order, so appending keeps every position list sorted
+        parallel_for(threads, [&](unsigned s) {
+            PositionTable& merged = local[0][s];
+            for (unsigned t = 1; t < threads; t++) {
+                for (auto& [pair, positions] : local[t][s]) {
+                    vector<uint32_t>& dst = merged[pair];
+                    dst.insert(dst.end(), positions.begin(), positions.end());
+                }
+                PositionTable().swap(local[t][s]);
             }
+        });
+
+        vector<pair<const Pair, vector<uint32_t>>*> order;
+        for (unsigned s = 0; s < threads; s++) {
+            for (auto& entry : local[0][s]) order.push_back(&entry);
+        }
+        sort(order.begin(), order.end(), [](const auto* a, const auto* b) {
+            return a->second.front() < b->second.front();
+        });
+
+        vector<uint32_t> heads(order.size());
+        freqs.reserve(order.size());
+        for (size_t k = 0; k < order.size(); k++) {
+            const auto& [pair, positions] = *order[k];
+            heads[k] = occurrences.alloc_chain(positions.size());
+            freqs.push(pair, PairOccurrences{pair, (uint32_t)positions.size(), heads[k]});
         }
+        parallel_for(threads, [&](unsigned t) {
+            for (size_t k = t; k < order.size(); k += threads) {
+                occurrences.fill_chain(heads[k], order[k]->second.data(), order[k]->second.size());
+            }
+        });
     }
+    // Merges one occurrence of merged into new_token if it is still live and
+    // reports the neighbouring pair changes through dec/inc. Returns false for
+    // positions invalidated by earlier merges.
+    template <typename Dec, typename Inc>
+    bool merge_at(Pair merged, Token new_token, uint32_t occurence, Dec dec, Inc inc) {
+        // skip positions invalidated by earlier merges
+        if (!tokens_arr.exists(occurence) || tokens_arr[occurence] != merged.l) return false;
+        uint32_t next = tokens_arr.get_next_index(occurence);
+        if (next == tokens_arr.npos || tokens_arr[next] != merged.r) return false;
+        uint32_t prev = tokens_arr.get_prev_index(occurence);
+        uint32_t after = tokens_arr.get_next_index(next);
 
-    BPE_Encoding(const vector<char>& input) : freqs([](const pair<Pair, PairOccurrences>& p) { return p.second.occurrences.size(); }) {
-        since_last_print = chrono::system_clock::now();
-        start = chrono::system_clock::now();
-        vector<Token> tokens;
-        iterations = 0;
-        highest_freq = 0;
-        for (const unsigned char& c : input) {
-            tokens.push_back((size_t)c);
+        // neither neighbour pair exists if it would cross a segment start
+        bool left = prev != tokens_arr.npos && !_segment_start(occurence);
+        bool right = after != tokens_arr.npos && !_segment_start(after);
+
+        // if previous exists, decrease old left (ab) if a exists
+        if (left) {
+            dec(Pair{tokens_arr[prev], merged.l}, prev);
         }
 
-        // construct the linked array of tokens
-        tokens_arr.fill(tokens);
+        // decrease old right (cd) if d exists
+        if (right) {
+            dec(Pair{merged.r, tokens_arr[after]}, next);
+        }
 
-        for (Token i = 0; i < 256; i++) {
-            grammar.push_back(Pair{i, 0});
+        // dont forget to decrease THIS occurence:
+        dec(merged, occurence);
+
+        // finally perform the replacement
+        tokens_arr.merge_successor(occurence, new_token);
+
+        // increase new left (aZ) but only if there was already a token in tokens_out
+        if (left) {
+            inc(Pair{tokens_arr[prev], new_token}, prev);
+        }
+
+        // increase new right (Zd) but only if there is a future token in input
+        if (right) {
+            inc(Pair{new_token, tokens_arr[after]}, occurence);
         }
+        return true;
+    }
+
+    // replaces every live occurrence of merged with new_token and updates the
+    // counts of the neighbouring pairs
+    void apply_merge(Pair merged, Token new_token) {
+        // detach the position chain; the positions are copied out first, so the
+        // blocks can go straight back to the pool
+        uint32_t chain;
+        freqs.update(merged, [&](PairOccurrences& po) {
+            chain = po.head;
+            po.head = OccurrencePool::NIL;
+        });
+        merge_positions.clear();
+        occurrences.for_each(chain, [&](uint32_t occurence) {
+            merge_positions.push_back(occurence);
+        });
+        occurrences.release(chain);
+
+        // left to right, so overlapping runs like "aaaa" merge the same way
+        // whether or not the parallel path is taken
+        sort(merge_positions.begin(), merge_positions.end());
 
-        for (size_t i = 0; i < tokens.size(); i++) {
-            if (i < tokens.size() - 1) {
-                Pair pair = Pair{tokens[i], tokens[i+1]};
-                inc_pair(pair, i);
+        if (threads > 1 && freqs.view(merged).count >= PARALLEL_MERGE_MIN) {
+            apply_merge_parallel(merged, new_token);
+        } else {
+            size_t merged_count = 0;
+            for (uint32_t occurence : merge_positions) {
+                merged_count += merge_at(merged, new_token, occurence,
+                    [&](Pair p, uint32_t i) { dec_pair(p, i); },
+                    [&](Pair p, uint32_t i) { inc_pair(p, i); });
             }
+            tokens_arr.shrink(merged_count);
         }
+        assert(!freqs.contains(merged));
+        TELEMETRY_ADD(merges, 1);
+        TELEMETRY_ADD(occurrences, merge_positions.size());
+        TELEMETRY_SET(tokens, tokens_arr.size());
+        TELEMETRY_SET(table_size, freqs.size());
+        TELEMETRY_SET(highest_freq, highest_freq);
     }
 
-    friend ostream& serialize(ostream& os, BPE_Encoding& bpe) {
-        os << "bpe";
-        os.write(reinterpret_cast<char*>(bpe.tokens_arr.size()), sizeof(bpe.tokens_arr.size()));
-        for (const auto& tok : bpe.tokens_arr) {
-            os.write(reinterpret_cast<char*>(tok), sizeof(tok));
+    struct PairDelta {
+        int64_t count;
+        vector<uint32_t> added;
+    };
+
+    // Walks freqs from the highest count down until f returns false. Backends
+    // without an ordered walk get their top limit entries sorted up front.
+    template <typename F>
+    void _for_each_descending(size_t limit, F f) const {
+        if constexpr (DescendingPriorityMap<decltype(freqs), Pair, PairOccurrences>) {
+            freqs.for_each_descending(f);
+        } else {
+            vector<const pair<Pair, PairOccurrences>*> entries;
+            entries.reserve(freqs.size());
+            for (const auto& entry : freqs) entries.push_back(&entry);
+            auto by_count = [](const auto* a, const auto* b) { return a->second.count > b->second.count; };
+            size_t wanted = min(entries.size(), limit);
+            partial_sort(entries.begin(), entries.begin() + wanted, entries.end(), by_count);
+            for (size_t i = 0; i < wanted; i++) {
+                if (!f(*entries[i])) return;
+            }
+        }
+    }
+
+    // Splits tokens_arr into one index range per thread. Every worker merges
+    // the occurrences whose neighbourhood (prev, the pair, and the token after
+    // it) lies entirely in its own range, recording pair count changes in a
+    // local table instead of touching freqs. The tables are summed and applied
+    // after the join, then the occurrences that straddle a range boundary are
+    // merged serially.
+    void apply_merge_parallel(Pair merged, Token new_token) {
+        typedef unordered_map<Pair, PairDelta, PairHash> DeltaTable;
+        size_t n = tokens_arr.capacity();
+        size_t shard_size = (n + threads - 1) / threads;
+        vector<DeltaTable> deltas(threads);
+        vector<vector<uint32_t>> deferred(threads);
+        vector<size_t> merged_counts(threads, 0);
+
+        // merge_positions is sorted, so each shard is a contiguous slice
+        vector<size_t> bounds(threads + 1);
+        for (unsigned t = 0; t <= threads; t++) {
+            bounds[t] = lower_bound(merge_positions.begin(), merge_positions.end(), min(n, t * shard_size)) - merge_positions.begin();
         }
+
+        parallel_for(threads, [&](unsigned t) {
+            size_t lo = t * shard_size;
+            size_t hi = min(n, lo + shard_size);
+            DeltaTable& delta = deltas[t];
+            uint32_t last_deferred = tokens_arr.npos;
+            for (size_t k = bounds[t]; k < bounds[t + 1]; k++) {
+                uint32_t occurence = merge_positions[k];
+                if (tokens_arr[occurence] != merged.l) continue;
+                // only read slots of this shard until the occurrence is known to fit
+                uint32_t next = tokens_arr.get_next_index(occurence);
+                if (next == tokens_arr.npos) continue;
+                uint32_t prev = tokens_arr.get_prev_index(occurence);
+                bool fits = next < hi && (prev == tokens_arr.npos || prev >= lo);
+                if (fits) {
+                    uint32_t after = tokens_arr.get_next_index(next);
+                    fits = after == tokens_arr.npos || after < hi;
+                }
+                // an occurrence overlapping a deferred one must wait for it
+                if (!fits || (prev != tokens_arr.npos && prev == last_deferred)) {
+                    deferred[t].push_back(occurence);
+                    last_deferred = occurence;
+                    continue;
+                }
+                merged_counts[t] += merge_at(merged, new_token, occurence,
+                    [&](Pair p, uint32_t) { delta[p].count--; },
+                    [&](Pair p, uint32_t i) {
+                        PairDelta& d = delta[p];
+                        d.count++;
+                        d.added.push_back(i);
+                    });
+            }
+        });
+
+        DeltaTable& total = deltas[0];
+        for (unsigned t = 1; t < threads; t++) {
+            for (auto& [pair, d] : deltas[t]) {
+                PairDelta& dst = total[pair];
+                dst.count += d.count;
+                dst.added.insert(dst.added.end(), d.added.begin(), d.added.end());
+            }
+            tokens_arr.shrink(merged_counts[t]);
+        }
+        tokens_arr.shrink(merged_counts[0]);
+
+        // apply in pair order so the result does not depend on the thread count
+        vector<pair<const Pair, PairDelta>*> order;
+        for (auto& entry : total) order.push_back(&entry);
+        sort(order.begin(), order.end(), [](const auto* a, const auto* b) {
+            return a->first.l != b->first.l ? a->first.l < b->first.l : a->first.r < b->first.r;
+        });
+        for (auto* entry : order) {
+            const Pair& pair = entry->first;
+            PairDelta& d = entry->second;
+            TELEMETRY_ADD(pair_incs, d.added.size());
+            TELEMETRY_ADD(pair_decs, d.added.size() - d.count);
+            if (!freqs.contains(pair)) {
+                assert(d.count >= 0);
+                if (d.count == 0) continue; // created and consumed within one shard
+                uint32_t head = occurrences.alloc_chain(d.added.size());
+                occurrences.fill_chain(head, d.added.data(), d.added.size());
+                freqs.push(pair, PairOccurrences{pair, (uint32_t)d.count, head});
+                continue;
+            }
+            const PairOccurrences& po = freqs.update(pair, [&](PairOccurrences& po) {
+                po.count += d.count;
+                for (uint32_t i : d.added) po.head = occurrences.push(po.head, i);
+            });
+            if (po.count == 0) {
+                occurrences.release(freqs.erase(pair).second.head);
+            }
+        }
+
+        // boundary fix-up, still left to right
+        size_t merged_count = 0;
+        for (const auto& shard : deferred) {
+            for (uint32_t occurence : shard) {
+                merged_count += merge_at(merged, new_token, occurence,
+                    [&](Pair p, uint32_t i) { dec_pair(p, i); },
+                    [&](Pair p, uint32_t i) { inc_pair(p, i); });
+            }
+        }
+        tokens_arr.shrink(merged_count);
+    }
+
+public:
+    Queue<Pair, PairOccurrences, PairHash, PairCountKey> freqs;
+    Pair most_freq_pair;
+    size_t highest_freq;
+    FlatLinkedArray<Token> tokens_arr;
+    OccurrencePool occurrences;
+    vector<uint32_t> merge_positions; // scratch list for apply_merge
+    unsigned threads;
+    vector<Pair> grammar;
+    size_t iterations;
+    size_t batch_rounds;
+    size_t greedy_deviations;
+    size_t greedy_deficit;
+    chrono::time_point<std::chrono::system_clock> start;
+    chrono::time_point<std::chrono::system_clock> since_last_print;
+
+    BPE_Encoding(const string& input, unsigned threads = 0) : freqs(PairCountKey()) {
+        _init(reinterpret_cast<const unsigned char*>(input.data()), input.size(), threads);
+    }
+
+    BPE_Encoding(const vector<char>& input, unsigned threads = 0) : freqs(PairCountKey()) {
+        _init(reinterpret_cast<const unsigned char*>(input.data()), input.size(), threads);
+    }
+
+    // the mapping is only read during construction and may be closed afterwards;
+    // segmented pre-tokenizes it so that no merge crosses a segment start
+    BPE_Encoding(const MappedFile& input, unsigned threads = 0, bool segmented = false) : freqs(PairCountKey()) {
+        if (segmented) segment_starts(input.data(), input.size(), segment_starts_);
+        _init(input.data(), input.size(), threads);
+    }
+
+    // Continues training an existing grammar. tokens must already be encoded
+    // with it (see BPE_Encoder); new rules are appended after its own, so the
+    // ids it assigned stay the same.
+    BPE_Encoding(vector<Pair> base, const vector<Token>& tokens, unsigned threads = 0, bool segmented = false)
+        : freqs(PairCountKey()) {
+        if (segmented) token_segment_starts(tokens, base, segment_starts_);
+        grammar = std::move(base);
+        _init(tokens.data(), tokens.size(), threads);
+        iterations = grammar.size() > 256 ? grammar.size() - 256 : 0;
+    }
+
+    // empty encoding, to be filled by deserialize
+    BPE_Encoding() : freqs(PairCountKey()) {
+        _init((const Token*)nullptr, 0, 0);
+    }
+
+    friend ostream& serialize(ostream& os, BPE_Encoding& bpe) {
+        write_bpe(os, bpe.to_file());
         return os;
     }
 
@@ -161,6 +465,10 @@ public:
 
         cout << "elapsed time: " << elapsed_seconds.count() << "s\n";
         cout << "iteration: " << bpe.iterations << "\n";
+        if (bpe.batch_rounds > 0) {
+            os << "batch rounds: " << bpe.batch_rounds << " greedy deviations: " << bpe.greedy_deviations
+                << " (count deficit " << bpe.greedy_deficit << ")\n";
+        }
 #ifdef VERBOSE
         os << '[';
         for (const auto& tok : bpe.tokens_arr) {
@@ -188,158 +496,694 @@ public:
     // only one iteration
     void reduce() {
         iterations += 1;
-        pair<Pair, PairOccurrences> most = freqs.max();
+        if (freqs.size() == 0) {
+            highest_freq = 0;
+            return;
+        }
+        const pair<Pair, PairOccurrences>& most = freqs.max();
         most_freq_pair = most.first;
-        highest_freq = most.second.occurrences.size();
+        highest_freq = most.second.count;
 
         if (highest_freq <= 1 && iterations > 1) return; // not compressable
         grammar.push_back(most_freq_pair); // introduce a new token
 
-        while (freqs.contains(most_freq_pair) && freqs.view(most_freq_pair).occurrences.size() > 0) {
-            size_t occurence = *freqs.view(most_freq_pair).occurrences.begin();
-            if (tokens_arr.get_raw(occurence) == nullptr) continue;
-            Node<Token>* raw = tokens_arr.get_raw(occurence);
-            assert(raw != nullptr);
-
-            // if previous exists, decrease old left (ab) if a exists
-            if (raw->prev != nullptr) {
-                Pair lpair = {raw->prev->data,most_freq_pair.l};
-                dec_pair(lpair, raw->prev->index);
-            }
-
-            // decrease old right (cd) if d exists
-            if (raw->next != nullptr && raw->next->next != nullptr) {
-                Pair rpair = {most_freq_pair.r,raw->next->next->data};
-                dec_pair(rpair, raw->next->index);
-            }
-
-            // dont forget to decrease THIS occurence:
-            dec_pair(most_freq_pair, occurence);
-
-            // finally perform the replacement
-            tokens_arr.replace_pair(occurence, grammar.size() - 1);
-            raw = tokens_arr.get_raw(occurence);
+        apply_merge(most_freq_pair, grammar.size() - 1);
+    }
 
-            // increase new left (aZ) but only if there was already a token in tokens_out
-            if (raw->prev != nullptr) {
-                Pair lpair = {raw->prev->data, (Token)(grammar.size() - 1)};
-                inc_pair(lpair, raw->prev->index);
-            }
+    // Batched variant of reduce(): takes up to k of the most frequent pairs that
+    // share no token ids, so none of their occurrences can overlap and none of
+    // their counts changes while the others are applied. New ids are assigned in
+    // (count desc, l, r) order. Strict greedy could have picked a pair created
+    // earlier in the same batch instead; every such case is counted in
+    // greedy_deviations and the count difference summed in greedy_deficit.
+    void reduce_batch(size_t k) {
+        if (freqs.size() == 0) {
+            highest_freq = 0;
+            iterations += 1;
+            return;
+        }
+        vector<pair<Pair, size_t>> batch;
+        unordered_set<Token> used;
+        size_t scanned = 0;
+        _for_each_descending(k * BATCH_SCAN_FACTOR + 1, [&](const pair<Pair, PairOccurrences>& entry) {
+            if (entry.second.count <= 1 || batch.size() == k || scanned++ == k * BATCH_SCAN_FACTOR) return false;
+            Pair p = entry.first;
+            if (used.count(p.l) || used.count(p.r)) return true;
+            used.insert(p.l);
+            used.insert(p.r);
+            batch.push_back({p, entry.second.count});
+            return true;
+        });
+        if (batch.empty()) {
+            iterations += 1;
+            most_freq_pair = freqs.max().first;
+            highest_freq = freqs.max().second.count;
+            return;
+        }
+        sort(batch.begin(), batch.end(), [](const auto& a, const auto& b) {
+            if (a.second != b.second) return a.second > b.second;
+            return a.first.l != b.first.l ? a.first.l < b.first.l : a.first.r < b.first.r;
+        });
 
-            // increase new right (Zd) but only if there is a future token in input
-            if (raw->next != nullptr) {
-                Pair rpair = {(Token)(grammar.size() - 1), raw->next->data};
-                inc_pair(rpair, occurence);
+        batch_rounds += 1;
+        most_freq_pair = batch.front().first;
+        highest_freq = batch.front().second;
+        for (const auto& [p, count] : batch) {
+            size_t best = freqs.max().second.count;
+            if (best > count) {
+                greedy_deviations += 1;
+                greedy_deficit += best - count;
             }
+            iterations += 1;
+            grammar.push_back(p);
+            apply_merge(p, grammar.size() - 1);
         }
     }
 
     void compress() {
         reduce();
-        while (highest_freq >= 1) {
+        while (highest_freq > 1) {
             reduce();
         }
     }
 
-    void serialize(const string& fname) {
-        ofstream file(fname, ios::binary); // Open file in binary mode
-        if (!file) {
-            cerr << "Error opening file: " << fname << endl;
-            return;
-        }
-
-        file.write("bpe0.01", 7);
-        file.write(reinterpret_cast<const char*>(&iterations), sizeof(iterations)); // not needed
-        size_t size = tokens_arr.size();
-        file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    // snapshot of the compressed token stream and grammar in .bpe form
+    BPEFile to_file() {
+        BPEFile file;
+        file.flags = segmented() ? BPE_FLAG_SEGMENTED : 0;
+        file.iterations = iterations;
+        file.tokens.reserve(tokens_arr.size());
         for (const auto& token : tokens_arr) {
-            file.write(reinterpret_cast<const char*>(&token), sizeof(token)); // not needed
-        }
-        size = grammar.size();
-        file.write(reinterpret_cast<const char*>(&size), sizeof(size));
-        for (const auto& pair : grammar) {
-            file.write(reinterpret_cast<const char*>(&pair.l), sizeof(pair.l));
-            file.write(reinterpret_cast<const char*>(&pair.r), sizeof(pair.r));
+            file.tokens.push_back(token);
         }
-        file.close();
+        file.grammar = grammar;
+        return file;
     }
 
-    void deserialize(const string& fname) {
-        ifstream file(fname, ios::binary); // Open file in binary mode
-        size_t grammar_size;
-        size_t tokens_arr_size;
-        string version;
+    bool serialize(const string& fname) {
+        return write_bpe(fname, to_file());
+    }
 
-        if (!file) {
-            cerr << "Error opening file: " << fname << endl;
-            return;
-        }
+    bool segmented() const {
+        return !segment_starts_.empty();
+    }
 
-        file >> version;
-        if (version != "bpe0.01") {
-            cerr << "Unsupported version: " << version << endl;
-            return;
+    // tokenizer artifact for the current grammar, see VocabImage
+    bool save_vocab(const string& fname) {
+        return write_vocab(fname, grammar, segmented() ? BPE_FLAG_SEGMENTED : 0);
+    }
+
+    // Loads a .bpe file (a finished run or a checkpoint) into a freshly
+    // constructed encoding. The pair counts are recounted from the token
+    // stream with count_pairs, which is far cheaper than replaying the merges,
+    // so training can carry on from the saved state.
+    bool deserialize(const string& fname, unsigned threads = 0) {
+        BPEFile file;
+        if (!read_bpe(fname, file)) return false;
+        if (file.flags & BPE_FLAG_GRAMMAR_ONLY) {
+            cerr << fname << " holds only a grammar (from --stream), so training cannot resume from it" << endl;
+            return false;
         }
+        assert(tokens_arr.size() == 0);
+        if (file.flags & BPE_FLAG_SEGMENTED) token_segment_starts(file.tokens, file.grammar, segment_starts_);
+        grammar = std::move(file.grammar);
+        _init(file.tokens.data(), file.tokens.size(), threads ? threads : this->threads);
+        iterations = file.iterations;
+        return true;
+    }
 
-        file >> iterations;
-        file >> tokens_arr_size;
+};
 
-        //tokens_arr.clear();
-        assert(tokens_arr.size() == 0);
-        for (Token i = 0; i < tokens_arr_size; ++i) {
-            Token token;
-            file >> token;
-            //tokens_arr.push(token);
-        }
+// encodes input with any tokenizer that has encode(data, size, out) and
+// writes the tokens to output as raw uint32
+template <typename Encoder>
+int encode_file(const Encoder& encoder, const string& input, const string& output) {
+    MappedFile text(input);
+    if (!text.ok()) return 1;
+    vector<Token> tokens;
+    auto begin = chrono::steady_clock::now();
+    encoder.encode(text.data(), text.size(), tokens);
+    chrono::duration<double> elapsed_seconds = chrono::steady_clock::now() - begin;
+    cout << "Encoded " << text.size() << " bytes into " << tokens.size() << " tokens in " << elapsed_seconds.count()
+        << "s (" << text.size() / 1e6 / elapsed_seconds.count() << " MB/s)" << endl;
+    ofstream file(output, ios::binary);
+    file.write(reinterpret_cast<const char*>(tokens.data()), tokens.size() * sizeof(Token));
+    return file ? 0 : 1;
+}
+
+int decode_file(const BPE_Decoder& decoder, const string& input, const string& output) {
+    ifstream in(input, ios::binary);
+    ofstream out(output, ios::binary);
+    if (!in || !out) {
+        cerr << "Error opening file: " << (in ? output : input) << endl;
+        return 1;
+    }
+    auto begin = chrono::steady_clock::now();
+    size_t written;
+    try {
+        written = decoder.decode_stream(in, out, 1 << 20);
+    } catch (const BadToken& e) {
+        cerr << "Token " << e.token << " at position " << e.index << " of " << input << " " << e.what() << endl;
+        return 1;
+    }
+    out.flush();
+    chrono::duration<double> elapsed_seconds = chrono::steady_clock::now() - begin;
+    cout << "Decoded " << written << " bytes in " << elapsed_seconds.count() << "s ("
+        << written / 1e6 / elapsed_seconds.count() << " MB/s)" << endl;
+    return out ? 0 : 1;
+}
+
+// expands a .bpe or .bpz file back into the original bytes
+int unpack_file(const string& input, const string& output) {
+    BPEFile bpe;
+    ifstream probe(input, ios::binary);
+    char magic[8] = {0};
+    probe.read(magic, sizeof(magic));
+    probe.close();
+    auto begin = chrono::steady_clock::now();
+    bool entropy = memcmp(magic, "bpz", 3) == 0; // read_bpz checks the version
+    if (!(entropy ? read_bpz(input, bpe) : read_bpe(input, bpe))) return 1;
+    if (bpe.flags & BPE_FLAG_GRAMMAR_ONLY) {
+        cerr << input << " holds only a grammar (from --stream) and has no text to unpack" << endl;
+        return 1;
+    }
+    ByteBuffer bytes;
+    auto decode_begin = chrono::steady_clock::now();
+    try {
+        BPE_Decoder decoder(bpe.grammar);
+        decode_begin = chrono::steady_clock::now();
+        decoder.decode(bpe.tokens.data(), bpe.tokens.size(), bytes);
+    } catch (const BadToken& e) {
+        cerr << "Token " << e.token << " at position " << e.index << " of " << input << " " << e.what() << endl;
+        return 1;
+    } catch (const invalid_argument& e) {
+        cerr << "Invalid grammar in " << input << ": " << e.what() << endl;
+        return 1;
+    }
+    auto end = chrono::steady_clock::now();
+    chrono::duration<double> elapsed_seconds = end - begin, decode_seconds = end - decode_begin;
+    cout << "Unpacked " << bytes.size() << " bytes in " << elapsed_seconds.count() << "s ("
+        << bytes.size() / 1e6 / elapsed_seconds.count() << " MB/s, decode alone "
+        << bytes.size() / 1e6 / decode_seconds.count() << " MB/s)" << endl;
+    ofstream out(output, ios::binary);
+    out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    return out ? 0 : 1;
+}
+
+// Writes about size bytes of English-like text: words built from a fixed
+// syllable set, drawn with Zipf-distributed frequencies from a vocabulary of
+// a few thousand, in sentences and paragraphs. The output depends only on
+// size and seed, so benchmarks can regenerate the same corpus anywhere.
+bool write_synthetic_corpus(const string& fname, size_t size, uint64_t seed = 1) {
+    static const char* syllables[] = {"the", "an", "or", "in", "er", "re", "on", "at", "en", "es", "ti", "st", "ar",
+        "nd", "to", "it", "ou", "ea", "ha", "is", "ing", "ion", "ent", "ver", "al", "ly", "ble", "pro", "com", "con"};
+    const size_t n_syllables = sizeof(syllables) / sizeof(syllables[0]);
+    uint64_t state = seed;
+    auto next = [&state]() { return mix64(state += 0x9e3779b97f4a7c15ull); };
 
-        file >> grammar_size;
-        grammar.clear();
-        for (Token i = 0; i < grammar.size(); ++i) {
-            Token l, r;
-            file >> l >> r;
-            grammar.push_back({l, r});
+    vector<string> words(4096);
+    vector<double> cumulative(words.size());
+    double total = 0;
+    for (size_t i = 0; i < words.size(); i++) {
+        size_t parts = 1 + next() % 3;
+        for (size_t j = 0; j < parts; j++) words[i] += syllables[next() % n_syllables];
+        total += 1.0 / (i + 1);
+        cumulative[i] = total;
+    }
+
+    string text;
+    text.reserve(size + 64);
+    bool capital = true;
+    while (text.size() < size) {
+        double r = (next() >> 11) * (1.0 / (1ull << 53)) * total;
+        const string& word = words[lower_bound(cumulative.begin(), cumulative.end(), r) - cumulative.begin()];
+        text += capital ? string(1, toupper(word[0])) + word.substr(1) : word;
+        capital = false;
+        uint64_t p = next() % 100;
+        if (p < 6) {
+            text += ". ";
+            capital = true;
+            if (p == 0) text += "\n\n";
+        } else if (p < 10) {
+            text += ", ";
+        } else {
+            text += ' ';
         }
-        file.close();
     }
+    text.resize(size);
 
+    ofstream file(fname, ios::binary);
+    if (!file) {
+        cerr << "Error opening file: " << fname << endl;
+        return false;
+    }
+    file.write(text.data(), text.size());
+    return bool(file);
+}
+
+// Times one phase of --bench and prints it as a JSON line with its
+// throughput, the allocations made during it (with -DALLOC_COUNTS) and the
+// peak RSS of the process so far.
+class BenchPhase {
+private:
+    string prefix_;
+    chrono::steady_clock::time_point begin_;
+    AllocCounts allocs_;
+
+public:
+    BenchPhase(const string& corpus, const string& backend, const string& phase)
+        : prefix_("{\"corpus\":\"" + corpus + "\",\"backend\":\"" + backend + "\",\"phase\":\"" + phase + "\""),
+          begin_(chrono::steady_clock::now()), allocs_(alloc_counts()) {}
+
+    void done(uint64_t bytes, size_t merges = 0) {
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - begin_;
+        AllocCounts now = alloc_counts();
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        double seconds = elapsed.count();
+        cout << prefix_ << ",\"seconds\":" << seconds << ",\"bytes\":" << bytes
+            << ",\"mb_per_s\":" << (seconds > 0 ? bytes / 1e6 / seconds : 0.0);
+        if (merges) cout << ",\"merges\":" << merges << ",\"merges_per_s\":" << (seconds > 0 ? merges / seconds : 0.0);
+        cout << ",\"allocs\":" << now.allocs - allocs_.allocs << ",\"alloc_bytes\":" << now.bytes - allocs_.bytes
+            << ",\"peak_rss_kb\":" << usage.ru_maxrss << "}" << endl;
+    }
 };
 
-vector<char> readFileToBytes(const string& filename) {
-    ifstream file(filename, ios::binary); // Open file in binary mode
-    if (!file) {
-        cerr << "Error opening file: " << filename << endl;
-        return {};
+struct TrainOptions {
+    string input;
+    string output;
+    unsigned threads;
+    size_t batch;
+    size_t print_every;
+    string vocab_out;
+    string entropy_out;
+    string blocks_out;
+    size_t block_size;
+    string telemetry_out; // "-" for stderr
+    size_t telemetry_interval_ms;
+    bool bench;
+    string checkpoint;
+    size_t checkpoint_every;
+    string resume;       // checkpoint to continue from instead of reading input
+    string base_model;   // grammar to extend with the rules learned from input
+    bool pretokenize;    // keep merges inside word-like segments
+};
+
+volatile sig_atomic_t interrupted = 0;
+
+// the first SIGINT/SIGTERM lets training stop cleanly, a second one kills
+extern "C" void on_interrupt(int sig) {
+    interrupted = 1;
+    signal(sig, SIG_DFL);
+}
+
+// Runs every phase on options.input (counting, training, serialization,
+// encoding and decoding) and prints one BenchPhase line per phase instead of
+// the usual progress. The decoded bytes are checked against the input.
+template <template <typename, typename, typename, typename> class Queue>
+int bench(const TrainOptions& options, const string& backend) {
+    string corpus = options.input.substr(options.input.find_last_of('/') + 1);
+    MappedFile text(options.input);
+    if (!text.ok()) return 1;
+    if (text.size() == 0) {
+        cerr << options.input << " is empty, there is nothing to benchmark" << endl;
+        return 1;
     }
 
-    // Get the size of the file
-    file.seekg(0, ios::end); // Move to the end of the file
-    streamsize size = file.tellg(); // Get the current position (size of the file)
-    file.seekg(0, ios::beg); // Move back to the beginning of the file
+    BenchPhase count(corpus, backend, "count");
+    BPE_Encoding<Queue> e(text, options.threads, options.pretokenize);
+    count.done(text.size());
 
-    vector<char> buffer(size); // Create a buffer to hold the bytes
-    if (!file.read(buffer.data(), size)) { // Read the file into the buffer
-        cerr << "Error reading file: " << filename << endl;
-        return {};
+    BenchPhase training(corpus, backend, "train");
+    do {
+        if (options.batch > 1) e.reduce_batch(options.batch);
+        else e.reduce();
+    } while (e.highest_freq > 1);
+    training.done(text.size(), e.grammar.size() - 256);
+
+    BenchPhase serialize(corpus, backend, "serialize");
+    if (!write_bpe(options.output, e.to_file())) return 1;
+    ifstream written(options.output, ios::binary | ios::ate);
+    serialize.done(written.tellg());
+
+    BenchPhase encode(corpus, backend, "encode");
+    BPE_Encoder encoder(e.grammar, options.pretokenize, options.threads);
+    vector<Token> tokens;
+    encoder.encode(text.data(), text.size(), tokens);
+    encode.done(text.size());
+
+    BenchPhase decode(corpus, backend, "decode");
+    BPE_Decoder decoder(e.grammar);
+    ByteBuffer bytes;
+    decoder.decode(tokens.data(), tokens.size(), bytes);
+    decode.done(bytes.size());
+
+    if (bytes.size() != text.size() || !equal(bytes.begin(), bytes.end(), text.data())) {
+        cerr << "Round trip failed for " << options.input << endl;
+        return 1;
     }
-    return buffer; // Return the buffer containing the bytes
+    return 0;
 }
 
-int main() {
-    cout << "Loading quixote..." << endl;
-    vector<char> test = readFileToBytes("./test.txt");
+// trains on options.input with the given frequency table backend and writes the results
+template <template <typename, typename, typename, typename> class Queue>
+int train(const TrainOptions& options, const string& backend) {
+    if (options.bench) return bench<Queue>(options, backend);
+    ofstream telemetry_file;
+    unique_ptr<TelemetryReporter> reporter;
+    if (!options.telemetry_out.empty()) {
+        ostream* out = &cerr;
+        if (options.telemetry_out != "-") {
+            telemetry_file.open(options.telemetry_out);
+            if (!telemetry_file) {
+                cerr << "Error opening file: " << options.telemetry_out << endl;
+                return 1;
+            }
+            out = &telemetry_file;
+        }
+        reporter = make_unique<TelemetryReporter>(*out, chrono::milliseconds(options.telemetry_interval_ms));
+    }
+    unique_ptr<BPE_Encoding<Queue>> encoding;
+    if (!options.resume.empty()) {
+        cout << "Resuming from " << options.resume << "..." << endl;
+        encoding = make_unique<BPE_Encoding<Queue>>();
+        if (!encoding->deserialize(options.resume, options.threads)) return 1;
+        if (options.pretokenize && !encoding->segmented()) {
+            cerr << options.resume << " was not trained with --pretokenize" << endl;
+            return 1;
+        }
+    } else if (!options.base_model.empty()) {
+        // the base model's own token stream (if it kept one) is already fully
+        // merged, so only the new text needs replaying; training then carries
+        // on over both
+        BPEFile base;
+        if (!read_bpe(options.base_model, base)) return 1;
+        // the base rules were learnt with or without segmentation, and the new
+        // text has to be cut the same way
+        bool segmented = base.flags & BPE_FLAG_SEGMENTED;
+        if (options.pretokenize && !segmented) {
+            cerr << options.base_model << " was not trained with --pretokenize" << endl;
+            return 1;
+        }
+        MappedFile corpus(options.input);
+        if (!corpus.ok()) return 1;
+        cout << "Replaying " << base.grammar.size() - 256 << " rules of " << options.base_model << " over "
+            << options.input << "..." << endl;
+        auto begin = chrono::steady_clock::now();
+        vector<Token> tokens = std::move(base.tokens);
+        size_t base_tokens = tokens.size();
+        BPE_Encoder(base.grammar, segmented, options.threads).encode(corpus.data(), corpus.size(), tokens);
+        chrono::duration<double> elapsed_seconds = chrono::steady_clock::now() - begin;
+        cout << "Encoded " << corpus.size() << " bytes into " << tokens.size() - base_tokens << " tokens in "
+            << elapsed_seconds.count() << "s, continuing from " << tokens.size() << " tokens" << endl;
+        encoding = make_unique<BPE_Encoding<Queue>>(std::move(base.grammar), tokens, options.threads, segmented);
+    } else {
+        cout << "Loading " << options.input << "..." << endl;
+        MappedFile corpus(options.input);
+        if (!corpus.ok()) return 1;
+        // an empty corpus trains no rules and leaves only the 256 terminals
+        if (corpus.size() == 0) cout << options.input << " is empty, no rules will be learnt" << endl;
+        encoding = make_unique<BPE_Encoding<Queue>>(corpus, options.threads, options.pretokenize);
+    }
     cout << "done." << endl;
-    BPE_Encoding e(test);
+    BPE_Encoding<Queue>& e = *encoding;
+    unique_ptr<CheckpointWriter> checkpoints;
+    if (!options.checkpoint.empty()) checkpoints = make_unique<CheckpointWriter>(options.checkpoint);
+    signal(SIGINT, on_interrupt);
+    signal(SIGTERM, on_interrupt);
+
     cout << e;
     e.reduce();
     cout << e;
-    while (e.highest_freq > 1) {
-        e.reduce();
-        if (e.iterations % PRINT_EVERY == 0)
+    while (e.highest_freq > 1 && !interrupted) {
+        size_t before = e.iterations;
+        if (options.batch > 1) e.reduce_batch(options.batch);
+        else e.reduce();
+        if (e.iterations / options.print_every != before / options.print_every)
             cout << e;
+        // the snapshot is a copy, so the writer never races the next merges
+        if (checkpoints && e.iterations / options.checkpoint_every != before / options.checkpoint_every)
+            checkpoints->submit(e.to_file());
     }
     cout << e;
-    cout << "Serializing to test.bpe..." << endl;
-    e.serialize("test.bpe");
+    if (reporter) reporter->stop();
+    if (checkpoints) {
+        checkpoints->submit(e.to_file());
+        checkpoints->flush();
+        cout << "Wrote " << checkpoints->written() << " checkpoints to " << checkpoints->path() << endl;
+    }
+    if (interrupted) cout << "Interrupted after " << e.iterations << " iterations, saving the partial result." << endl;
+    chrono::duration<double> elapsed_seconds = chrono::system_clock::now() - e.start;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    cout << "backend " << backend << " merges " << e.grammar.size() - 256 << " seconds " << elapsed_seconds.count()
+        << " merges/s " << (e.grammar.size() - 256) / elapsed_seconds.count() << " peak_rss_kb " << usage.ru_maxrss;
+#ifdef HEAP_OP_COUNTS
+    cout << " " << e.freqs.ops(); // all zero otherwise
+#endif
+    cout << endl;
+    cout << "Serializing to " << options.output << "..." << endl;
+    // every writer prints its own error
+    bool written = e.serialize(options.output);
+    if (!options.vocab_out.empty()) written = e.save_vocab(options.vocab_out) && written;
+    if (!options.entropy_out.empty()) written = write_bpz(options.entropy_out, e.to_file()) && written;
+    if (!options.blocks_out.empty()) written = write_blocks(options.blocks_out, e.to_file(), options.block_size) && written;
+    if (!written) return 1;
     cout << "Serialization complete." << endl;
-    return 0;
+    return interrupted ? 130 : 0;
+}
+
+int main(int argc, char** argv) {
+    string input = "./test.txt";
+    string output = "test.bpe";
+    size_t batch = 1;
+    unsigned threads = 0;
+    bool stream = false;
+    size_t chunk_size = 1 << 20;
+    string model;
+    string trie_model;
+    string trie;
+    string decode_model;
+    string vocab_out;
+    string vocab_model;
+    string vocab;
+    string vocab_decode;
+    string entropy_out;
+    string unpack;
+    string blocks_out;
+    string blocks_model;
+    string read_blocks;
+    size_t block_size = BLOCK_DEFAULT_SIZE;
+    size_t print_every = PRINT_EVERY;
+    string telemetry_out;
+    size_t telemetry_interval_ms = TELEMETRY_INTERVAL_MS;
+    bool run_bench = false;
+    string checkpoint;
+    size_t checkpoint_every = CHECKPOINT_EVERY;
+    string resume;
+    string base_model;
+    bool pretokenize = false;
+    string synthetic;
+    string backend = "bucket";
+    vector<string> positional;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--batch" && i + 1 < argc) {
+            batch = stoul(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = stoul(argv[++i]);
+        } else if (arg == "--stream") {
+            stream = true;
+        } else if (arg == "--chunk-size" && i + 1 < argc) {
+            chunk_size = stoul(argv[++i]);
+        } else if (arg == "--encode" && i + 1 < argc) {
+            model = argv[++i];
+        } else if (arg == "--build-trie" && i + 1 < argc) {
+            trie_model = argv[++i];
+        } else if (arg == "--trie-encode" && i + 1 < argc) {
+            trie = argv[++i];
+        } else if (arg == "--decode" && i + 1 < argc) {
+            decode_model = argv[++i];
+        } else if (arg == "--vocab" && i + 1 < argc) {
+            vocab_out = argv[++i];
+        } else if (arg == "--build-vocab" && i + 1 < argc) {
+            vocab_model = argv[++i];
+        } else if (arg == "--vocab-encode" && i + 1 < argc) {
+            vocab = argv[++i];
+        } else if (arg == "--vocab-decode" && i + 1 < argc) {
+            vocab_decode = argv[++i];
+        } else if (arg == "--entropy" && i + 1 < argc) {
+            entropy_out = argv[++i];
+        } else if (arg == "--unpack" && i + 1 < argc) {
+            unpack = argv[++i];
+        } else if (arg == "--blocks" && i + 1 < argc) {
+            blocks_out = argv[++i];
+        } else if (arg == "--build-blocks" && i + 1 < argc) {
+            blocks_model = argv[++i];
+        } else if (arg == "--block-size" && i + 1 < argc) {
+            block_size = stoul(argv[++i]);
+        } else if (arg == "--read" && i + 1 < argc) {
+            read_blocks = argv[++i];
+        } else if (arg == "--print-every" && i + 1 < argc) {
+            print_every = max(1ul, stoul(argv[++i]));
+        } else if (arg == "--telemetry" && i + 1 < argc) {
+            telemetry_out = argv[++i];
+        } else if (arg == "--telemetry-interval" && i + 1 < argc) {
+            telemetry_interval_ms = max(1ul, stoul(argv[++i]));
+        } else if (arg == "--checkpoint" && i + 1 < argc) {
+            checkpoint = argv[++i];
+        } else if (arg == "--checkpoint-every" && i + 1 < argc) {
+            checkpoint_every = max(1ul, stoul(argv[++i]));
+        } else if (arg == "--resume" && i + 1 < argc) {
+            resume = argv[++i];
+        } else if (arg == "--continue" && i + 1 < argc) {
+            base_model = argv[++i];
+        } else if (arg == "--pretokenize") {
+            pretokenize = true;
+        } else if (arg == "--bench") {
+            run_bench = true;
+        } else if (arg == "--synthetic" && i + 1 < argc) {
+            synthetic = argv[++i];
+        } else if (arg == "--backend" && i + 1 < argc) {
+            backend = argv[++i];
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() > 0) input = positional[0];
+    if (positional.size() > 1) output = positional[1];
+
+    if (!model.empty()) {
+        if (positional.size() < 2) output = input + ".tok";
+        BPEFile bpe;
+        if (!read_bpe(model, bpe, false)) return 1;
+        return encode_file(BPE_Encoder(bpe.grammar, bpe.flags & BPE_FLAG_SEGMENTED, threads), input, output);
+    }
+
+    if (!trie_model.empty()) {
+        if (positional.size() < 1) input = trie_model + ".trie";
+        BPEFile bpe;
+        if (!read_bpe(trie_model, bpe, false)) return 1;
+        BPE_Trie t(bpe.grammar, bpe.flags & BPE_FLAG_SEGMENTED);
+        cout << "Built trie with " << t.nodes() << " nodes for " << bpe.grammar.size() << " rules, saving to " << input << endl;
+        return t.save(input) ? 0 : 1;
+    }
+
+    if (!trie.empty()) {
+        if (positional.size() < 2) output = input + ".tok";
+        BPE_Trie t;
+        if (!t.load(trie)) return 1;
+        return encode_file(t, input, output);
+    }
+
+    if (!vocab_model.empty()) {
+        if (positional.size() < 1) input = vocab_model + ".vocab";
+        BPEFile bpe;
+        if (!read_bpe(vocab_model, bpe, false)) return 1;
+        cout << "Writing vocab image for " << bpe.grammar.size() << " rules to " << input << endl;
+        return write_vocab(input, bpe.grammar, bpe.flags) ? 0 : 1;
+    }
+
+    if (!vocab.empty()) {
+        if (positional.size() < 2) output = input + ".tok";
+        VocabImage image(vocab);
+        if (!image.ok()) return 1;
+        return encode_file(image, input, output);
+    }
+
+    if (!decode_model.empty()) {
+        if (positional.size() < 2) output = input + ".out";
+        vector<Pair> grammar;
+        if (!read_grammar(decode_model, grammar)) return 1;
+        try {
+            return decode_file(BPE_Decoder(grammar), input, output);
+        } catch (const invalid_argument& e) {
+            cerr << "Invalid grammar in " << decode_model << ": " << e.what() << endl;
+            return 1;
+        }
+    }
+
+    if (!vocab_decode.empty()) {
+        if (positional.size() < 2) output = input + ".out";
+        VocabImage image(vocab_decode);
+        if (!image.ok()) return 1;
+        return decode_file(image.decoder(), input, output);
+    }
+
+    if (!unpack.empty()) {
+        if (positional.size() < 1) output = unpack + ".out";
+        else output = positional[0];
+        return unpack_file(unpack, output);
+    }
+
+    if (!blocks_model.empty()) {
+        if (positional.size() < 1) input = blocks_model + ".blocks";
+        BPEFile bpe;
+        if (!read_bpe(blocks_model, bpe)) return 1;
+        cout << "Writing " << bpe.tokens.size() << " tokens in blocks of " << block_size << " bytes to " << input << endl;
+        return write_blocks(input, bpe, block_size) ? 0 : 1;
+    }
+
+    if (!read_blocks.empty()) {
+        // positional arguments are the byte offset and length of the range
+        if (positional.size() < 2) {
+            cerr << "usage: --read <blocks file> <offset> <length>" << endl;
+            return 1;
+        }
+        BlockReader reader(read_blocks);
+        if (!reader.ok()) return 1;
+        vector<uint8_t> bytes;
+        try {
+            bytes = reader.read(stoull(positional[0]), stoull(positional[1]));
+        } catch (const runtime_error& e) {
+            cerr << e.what() << " in " << read_blocks << endl;
+            return 1;
+        }
+        cout.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        return cout ? 0 : 1;
+    }
+
+    if (!synthetic.empty()) {
+        // the positional argument is the size in bytes
+        if (positional.size() < 1) {
+            cerr << "usage: --synthetic <output file> <size in bytes>" << endl;
+            return 1;
+        }
+        return write_synthetic_corpus(synthetic, stoull(positional[0])) ? 0 : 1;
+    }
+
+    if (stream) {
+        // the streaming trainer cuts its own words, which are not the segments of pretokenize.hpp
+        if (pretokenize) {
+            cerr << "--pretokenize is not supported with --stream" << endl;
+            return 1;
+        }
+        cout << "Streaming " << input << " in " << chunk_size << " byte chunks..." << endl;
+        StreamingBPE s(chunk_size);
+        if (!s.add_file(input)) return 1;
+        s.prepare();
+        cout << s;
+        do {
+            s.reduce();
+            if (s.iterations % print_every == 0)
+                cout << s;
+        } while (s.highest_freq > 1);
+        cout << s;
+        cout << "Serializing to " << output << "..." << endl;
+        if (!s.serialize(output)) return 1;
+        cout << "Serialization complete." << endl;
+        return 0;
+    }
+
+    // resuming reads no input, so the only positional argument is the output
+    if (!resume.empty()) output = positional.size() > 0 ? positional[0] : resume;
+    TrainOptions options{input, output, threads, batch, print_every, vocab_out, entropy_out, blocks_out, block_size,
+        telemetry_out, telemetry_interval_ms, run_bench, checkpoint, checkpoint_every, resume,
+        base_model, pretokenize};
+    if (backend == "bucket") return train<BucketQueueMap>(options, backend);
+    if (backend == "binary") return train<HeapMap>(options, backend);
+    if (backend == "fib") return train<FibHeapMap>(options, backend);
+    if (backend == "pairing") return train<PairingHeapMap>(options, backend);
+    cerr << "Unknown backend: " << backend << endl;
+    return 1;
 }
@@ -0,0 +1,135 @@
+#pragma once
+#include <condition_variable>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include "bpe_format.hpp"
+
+using namespace std;
+
+// Checkpoints of a training run are ordinary .bpe files: the token stream,
+// the grammar and the iteration count are the whole state, since the pair
+// counts are rebuilt from the tokens on resume.
+
+// Writes bpe to fname so that a crash at any point leaves either the previous
+// file or the complete new one: the data goes to fname.tmp, is fsynced, and
+// is renamed over fname, then the directory entry is synced too.
+inline bool write_bpe_atomic(const string& fname, const BPEFile& bpe) {
+    ostringstream buffer;
+    write_bpe(buffer, bpe);
+    string data = std::move(buffer).str();
+    string tmp = fname + ".tmp";
+
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cerr << "Error opening file: " << tmp << ": " << strerror(errno) << endl;
+        return false;
+    }
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    bool ok = done == data.size() && ::fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || ::rename(tmp.c_str(), fname.c_str()) != 0) {
+        cerr << "Error writing file: " << fname << ": " << strerror(errno) << endl;
+        ::unlink(tmp.c_str());
+        return false;
+    }
+
+    size_t slash = fname.find_last_of('/');
+    string dir = slash == string::npos ? "." : fname.substr(0, slash + 1);
+    int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        ::fsync(dir_fd);
+        ::close(dir_fd);
+    }
+    return true;
+}
+
+// Writes checkpoints on a background thread so training only pays for taking
+// the snapshot. If a new snapshot arrives while the last one is still being
+// written, the one waiting is replaced: only the latest state matters.
+class CheckpointWriter {
+private:
+    string fname_;
+    mutex mutex_;
+    condition_variable wake_;
+    condition_variable idle_;
+    BPEFile pending_;
+    bool has_pending_;
+    bool writing_;
+    bool stopping_;
+    size_t written_;
+    thread thread_;
+
+    void _run() {
+        unique_lock<mutex> lock(mutex_);
+        while (true) {
+            wake_.wait(lock, [this] { return has_pending_ || stopping_; });
+            if (!has_pending_) return;
+            BPEFile snapshot = std::move(pending_);
+            has_pending_ = false;
+            writing_ = true;
+            lock.unlock();
+            bool ok = write_bpe_atomic(fname_, snapshot);
+            lock.lock();
+            writing_ = false;
+            if (ok) written_++;
+            idle_.notify_all();
+        }
+    }
+
+public:
+    explicit CheckpointWriter(const string& fname)
+        : fname_(fname), has_pending_(false), writing_(false), stopping_(false), written_(0),
+          thread_(&CheckpointWriter::_run, this) {}
+
+    CheckpointWriter(const CheckpointWriter&) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+    // writes whatever is still pending, then stops the thread
+    ~CheckpointWriter() {
+        {
+            lock_guard<mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        thread_.join();
+    }
+
+    void submit(BPEFile&& snapshot) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            pending_ = std::move(snapshot);
+            has_pending_ = true;
+        }
+        wake_.notify_one();
+    }
+
+    // blocks until every submitted snapshot is on disk
+    void flush() {
+        unique_lock<mutex> lock(mutex_);
+        idle_.wait(lock, [this] { return !has_pending_ && !writing_; });
+    }
+
+    // checkpoints completed so far
+    size_t written() {
+        lock_guard<mutex> lock(mutex_);
+        return written_;
+    }
+
+    const string& path() const {
+        return fname_;
+    }
+};
@@ -0,0 +1,405 @@
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <queue>
+#include <string>
+#include <vector>
+#include "bitpack.hpp"
+#include "bpe_format.hpp"
+#include "bpe_types.hpp"
+
+using namespace std;
+
+// Entropy coded variant of a .bpe file (bpz0.02), written after training to
+// get the actual compression ratio:
+//
+//   "bpz0.02\0" | varint iterations, flags, grammar_size, token_count
+//   | rule code | (l, r) of every rule from 256 on
+//   | token code | token stream | CRC-32 of all above
+//
+// Everything after the varints is one bit stream, most significant bit first.
+// Both streams are canonical Huffman coded. Tokens use one symbol per id. The
+// halves of the rules use one symbol per terminal and one per bit width of
+// larger ids, followed by the bits below the leading one (see _rule_symbol):
+// few rules are reused often, so a symbol per id would mostly pay for its
+// code length. A code is sent as its list of code lengths, itself Huffman
+// coded with a 5-bit length per length value.
+
+#define HUFFMAN_MAX_BITS 24   // longest code; frequencies are flattened until it fits
+#define HUFFMAN_TABLE_BITS 11 // codes up to this length decode with one lookup
+
+inline void write_varint(vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(value);
+}
+
+inline bool read_varint(const uint8_t*& pos, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; pos < end && shift < 64; shift += 7) {
+        uint8_t byte = *pos++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Bit stream written most significant bit first, as prefix codes are read.
+class MsbBitWriter {
+private:
+    vector<uint8_t>& out_;
+    uint64_t acc_;
+    uint32_t bits_;
+
+public:
+    MsbBitWriter(vector<uint8_t>& out) : out_(out), acc_(0), bits_(0) {}
+
+    void write(uint32_t value, uint32_t width) {
+        if (width == 0) return;
+        acc_ = acc_ << width | (value & ((1ull << width) - 1));
+        bits_ += width;
+        while (bits_ >= 8) {
+            bits_ -= 8;
+            out_.push_back(acc_ >> bits_);
+        }
+    }
+
+    void flush() {
+        if (bits_ > 0) out_.push_back(acc_ << (8 - bits_));
+        acc_ = 0;
+        bits_ = 0;
+    }
+};
+
+// Reader for MsbBitWriter output. Like BitReader it loads an unaligned 64-bit
+// word per peek, so the buffer needs 8 readable bytes past its end.
+class MsbBitReader {
+private:
+    const uint8_t* data_;
+    size_t bit_;
+    size_t limit_;
+
+public:
+    MsbBitReader(const uint8_t* data, size_t size) : data_(data), bit_(0), limit_(size * 8) {}
+
+    // the next 32 bits of the stream, zero past the end
+    uint32_t peek() const {
+        uint64_t word;
+        memcpy(&word, data_ + (bit_ >> 3), sizeof(word));
+        return __builtin_bswap64(word) << (bit_ & 7) >> 32;
+    }
+
+    void skip(uint32_t width) {
+        bit_ += width;
+    }
+
+    uint32_t read(uint32_t width) {
+        if (width == 0) return 0;
+        uint32_t value = peek() >> (32 - width);
+        skip(width);
+        return value;
+    }
+
+    // false once more bits were consumed than the stream holds
+    bool ok() const {
+        return bit_ <= limit_;
+    }
+};
+
+// Canonical Huffman code over the symbols 0 .. size - 1. Codes are assigned
+// in (length, symbol) order, so the lengths alone are enough to rebuild the
+// code on the decoding side.
+class HuffmanCode {
+private:
+    vector<uint32_t> first_code_;  // per length, code of the first symbol of that length
+    vector<uint32_t> first_index_; // per length, position of that symbol in sorted_
+    vector<uint32_t> count_;
+    vector<uint32_t> sorted_;      // symbols in code order
+    vector<uint32_t> table_;       // (symbol << 5 | length) for every HUFFMAN_TABLE_BITS prefix, 0 if longer
+
+public:
+    vector<uint8_t> length;        // 0 for symbols that never occur
+    vector<uint32_t> code;
+
+    // code lengths for the given frequencies, none longer than HUFFMAN_MAX_BITS
+    static vector<uint8_t> lengths_for(const vector<uint64_t>& freqs) {
+        vector<uint64_t> weights(freqs);
+        while (true) {
+            typedef pair<uint64_t, uint32_t> Node; // (weight, node id)
+            priority_queue<Node, vector<Node>, greater<Node>> heap;
+            vector<uint32_t> parent(weights.size(), 0);
+            for (uint32_t s = 0; s < weights.size(); s++) {
+                if (weights[s]) heap.push({weights[s], s});
+            }
+            vector<uint8_t> lengths(weights.size(), 0);
+            if (heap.size() == 1) {
+                lengths[heap.top().second] = 1;
+                return lengths;
+            }
+            while (heap.size() > 1) {
+                Node a = heap.top();
+                heap.pop();
+                Node b = heap.top();
+                heap.pop();
+                uint32_t id = parent.size();
+                parent.push_back(0);
+                parent[a.second] = id;
+                parent[b.second] = id;
+                heap.push({a.first + b.first, id});
+            }
+            // parents always come after their children, so depths resolve back to front
+            vector<uint32_t> depth(parent.size(), 0);
+            for (size_t n = parent.size() - 1; n-- > 0;) {
+                if (parent[n]) depth[n] = depth[parent[n]] + 1;
+            }
+            bool fits = true;
+            for (uint32_t s = 0; s < weights.size(); s++) {
+                if (!weights[s]) continue;
+                lengths[s] = min<uint32_t>(depth[s], 255);
+                fits = fits && depth[s] <= HUFFMAN_MAX_BITS;
+            }
+            if (fits) return lengths;
+            for (uint64_t& w : weights) {
+                if (w) w = (w >> 1) | 1;
+            }
+        }
+    }
+
+    // false for lengths no prefix code can have (the Kraft sum exceeds one)
+    static bool valid(const vector<uint8_t>& lengths) {
+        uint64_t kraft = 0;
+        for (uint8_t l : lengths) {
+            if (l > HUFFMAN_MAX_BITS) return false;
+            if (l) kraft += 1ull << (HUFFMAN_MAX_BITS - l);
+        }
+        return kraft <= 1ull << HUFFMAN_MAX_BITS;
+    }
+
+    HuffmanCode() {}
+
+    explicit HuffmanCode(const vector<uint8_t>& lengths) : length(lengths) {
+        code.assign(length.size(), 0);
+        count_.assign(HUFFMAN_MAX_BITS + 1, 0);
+        for (uint8_t l : length) {
+            if (l) count_[l]++;
+        }
+        first_code_.assign(HUFFMAN_MAX_BITS + 1, 0);
+        first_index_.assign(HUFFMAN_MAX_BITS + 1, 0);
+        uint32_t next_code = 0, index = 0;
+        for (uint32_t l = 1; l <= HUFFMAN_MAX_BITS; l++) {
+            first_code_[l] = next_code;
+            first_index_[l] = index;
+            next_code = (next_code + count_[l]) << 1;
+            index += count_[l];
+        }
+        sorted_.resize(index);
+        vector<uint32_t> fill(first_index_);
+        vector<uint32_t> next(first_code_);
+        for (uint32_t s = 0; s < length.size(); s++) {
+            if (!length[s]) continue;
+            sorted_[fill[length[s]]++] = s;
+            code[s] = next[length[s]]++;
+        }
+
+        table_.assign(1u << HUFFMAN_TABLE_BITS, 0);
+        for (uint32_t s = 0; s < length.size(); s++) {
+            if (!length[s] || length[s] > HUFFMAN_TABLE_BITS) continue;
+            uint32_t shift = HUFFMAN_TABLE_BITS - length[s];
+            for (uint32_t k = 0; k < (1u << shift); k++) {
+                table_[(code[s] << shift) | k] = s << 5 | length[s];
+            }
+        }
+    }
+
+    void write(MsbBitWriter& out, uint32_t symbol) const {
+        out.write(code[symbol], length[symbol]);
+    }
+
+    // Reads one symbol. Returns false on a bit pattern that is not a code,
+    // which can only come from a corrupt stream.
+    bool read(MsbBitReader& in, uint32_t& symbol) const {
+        uint32_t window = in.peek();
+        uint32_t entry = table_[window >> (32 - HUFFMAN_TABLE_BITS)];
+        if (entry) {
+            in.skip(entry & 31);
+            symbol = entry >> 5;
+            return true;
+        }
+        for (uint32_t l = HUFFMAN_TABLE_BITS + 1; l <= HUFFMAN_MAX_BITS; l++) {
+            uint32_t c = window >> (32 - l);
+            if (c - first_code_[l] < count_[l]) {
+                in.skip(l);
+                symbol = sorted_[first_index_[l] + c - first_code_[l]];
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Sends the code lengths of code, which the reader already knows the size of.
+inline void _write_code(MsbBitWriter& out, const HuffmanCode& code) {
+    vector<uint64_t> freqs(HUFFMAN_MAX_BITS + 1, 0);
+    for (uint8_t l : code.length) freqs[l]++;
+    HuffmanCode lengths(HuffmanCode::lengths_for(freqs));
+    for (uint8_t l : lengths.length) out.write(l, 5);
+    for (uint8_t l : code.length) lengths.write(out, l);
+}
+
+inline bool _read_code(MsbBitReader& in, size_t symbols, HuffmanCode& code) {
+    vector<uint8_t> meta(HUFFMAN_MAX_BITS + 1);
+    for (uint8_t& l : meta) l = in.read(5);
+    if (!HuffmanCode::valid(meta)) return false;
+    HuffmanCode lengths(meta);
+    vector<uint8_t> result(symbols);
+    for (uint8_t& l : result) {
+        uint32_t symbol;
+        if (!in.ok() || !lengths.read(in, symbol)) return false;
+        l = symbol;
+    }
+    if (!HuffmanCode::valid(result)) return false;
+    code = HuffmanCode(result);
+    return in.ok();
+}
+
+// symbol of a rule half: the id itself for a terminal, else 256 + bit width of
+// the id, with the bits below the leading one sent raw after it
+inline uint32_t _rule_symbol(Token id, uint32_t& extra_bits) {
+    if (id < 256) {
+        extra_bits = 0;
+        return id;
+    }
+    extra_bits = 31 - __builtin_clz(id);
+    return 256 + extra_bits + 1;
+}
+
+#define BPZ_RULE_SYMBOLS (256 + 33)
+
+inline bool write_bpz(const string& fname, const BPEFile& bpe) {
+    vector<uint8_t> out(8, 0);
+    memcpy(out.data(), "bpz0.02", 8);
+    write_varint(out, bpe.iterations);
+    write_varint(out, bpe.flags | BPE_FLAG_IMPLICIT_TERMINALS);
+    write_varint(out, bpe.grammar.size());
+    write_varint(out, bpe.tokens.size());
+
+    MsbBitWriter bits(out);
+    vector<uint64_t> rule_freqs(BPZ_RULE_SYMBOLS, 0);
+    uint32_t extra;
+    for (size_t i = 256; i < bpe.grammar.size(); i++) {
+        rule_freqs[_rule_symbol(bpe.grammar[i].l, extra)]++;
+        rule_freqs[_rule_symbol(bpe.grammar[i].r, extra)]++;
+    }
+    HuffmanCode rules(HuffmanCode::lengths_for(rule_freqs));
+    _write_code(bits, rules);
+    for (size_t i = 256; i < bpe.grammar.size(); i++) {
+        for (Token id : {bpe.grammar[i].l, bpe.grammar[i].r}) {
+            rules.write(bits, _rule_symbol(id, extra));
+            bits.write(id, extra);
+        }
+    }
+
+    vector<uint64_t> token_freqs(max<size_t>(bpe.grammar.size(), 256), 0);
+    for (Token t : bpe.tokens) token_freqs[t]++;
+    HuffmanCode tokens(HuffmanCode::lengths_for(token_freqs));
+    _write_code(bits, tokens);
+    for (Token t : bpe.tokens) tokens.write(bits, t);
+    bits.flush();
+
+    uint32_t crc = crc32(out.data(), out.size());
+    out.insert(out.end(), reinterpret_cast<uint8_t*>(&crc), reinterpret_cast<uint8_t*>(&crc) + sizeof(crc));
+
+    ofstream file(fname, ios::binary);
+    if (!file) {
+        cerr << "Error opening file: " << fname << endl;
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(out.data()), out.size());
+    if (!file) {
+        cerr << "Error writing file: " << fname << endl;
+        return false;
+    }
+    return true;
+}
+
+inline bool read_bpz(const string& fname, BPEFile& bpe) {
+    ifstream file(fname, ios::binary | ios::ate);
+    if (!file) {
+        cerr << "Error opening file: " << fname << endl;
+        return false;
+    }
+    size_t size = file.tellg();
+    file.seekg(0);
+    vector<uint8_t> buffer(size + 8, 0); // MsbBitReader reads up to 8 bytes ahead
+    if (!file.read(reinterpret_cast<char*>(buffer.data()), size)) {
+        cerr << "Error reading file: " << fname << endl;
+        return false;
+    }
+    uint32_t crc;
+    if (size < 12 || memcmp(buffer.data(), "bpz0.02", 8) != 0) {
+        cerr << "Unsupported version in " << fname << endl;
+        return false;
+    }
+    memcpy(&crc, buffer.data() + size - sizeof(crc), sizeof(crc));
+    if (crc32(buffer.data(), size - sizeof(crc)) != crc) {
+        cerr << "Checksum mismatch in " << fname << endl;
+        return false;
+    }
+
+    const uint8_t* pos = buffer.data() + 8;
+    const uint8_t* end = buffer.data() + size - sizeof(crc);
+    // every code is at least one bit long, which bounds the counts by the
+    // payload before anything is sized from them
+    uint64_t iterations, flags, grammar_size, token_count;
+    if (!read_varint(pos, end, iterations) || !read_varint(pos, end, flags) || !read_varint(pos, end, grammar_size)
+            || !read_varint(pos, end, token_count) || flags > UINT32_MAX || !(flags & BPE_FLAG_IMPLICIT_TERMINALS)
+            || grammar_size > UINT32_MAX || token_count > (uint64_t)(end - pos) * 8
+            || (grammar_size > 256 && grammar_size - 256 > (uint64_t)(end - pos) * 8 / 2)) {
+        cerr << "Corrupt header in " << fname << endl;
+        return false;
+    }
+
+    MsbBitReader bits(pos, end - pos);
+    HuffmanCode rules;
+    bool ok = _read_code(bits, BPZ_RULE_SYMBOLS, rules);
+    bpe.grammar.resize(grammar_size);
+    for (Token i = 0; i < 256 && i < grammar_size; i++) {
+        bpe.grammar[i] = Pair{i, 0};
+    }
+    for (size_t i = 256; ok && i < grammar_size; i++) {
+        Token half[2];
+        for (Token& id : half) {
+            uint32_t symbol;
+            ok = ok && bits.ok() && rules.read(bits, symbol) && symbol != 256; // 256 is never written
+            if (!ok) break;
+            uint32_t extra = symbol < 256 ? 0 : symbol - 257;
+            id = symbol < 256 ? symbol : (1u << extra) | bits.read(extra);
+        }
+        ok = ok && bits.ok() && half[0] < i && half[1] < i;
+        if (ok) bpe.grammar[i] = Pair{half[0], half[1]};
+    }
+    if (!ok) {
+        cerr << "Corrupt grammar in " << fname << endl;
+        return false;
+    }
+
+    HuffmanCode tokens;
+    ok = _read_code(bits, max<size_t>(grammar_size, 256), tokens);
+    bpe.tokens.resize(token_count);
+    for (size_t i = 0; ok && i < token_count; i++) {
+        uint32_t symbol = 0;
+        ok = bits.ok() && tokens.read(bits, symbol);
+        bpe.tokens[i] = symbol;
+    }
+    if (!ok || !bits.ok() || _bad_token(bpe.tokens, grammar_size) != SIZE_MAX) {
+        cerr << "Corrupt token stream in " << fname << endl;
+        return false;
+    }
+    bpe.iterations = iterations;
+    bpe.flags = flags;
+    return true;
+}
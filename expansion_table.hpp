@@ -0,0 +1,53 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#include "bpe_types.hpp"
+
+using namespace std;
+
+// The byte spelling of every grammar rule, stored back to back in one buffer
+// with an offset and length per token. Rules only refer to earlier ids, so the
+// table is built front to back by copying the two halves of each rule.
+class ExpansionTable {
+public:
+    vector<uint64_t> offset;
+    vector<uint32_t> length;
+    vector<uint8_t> bytes;
+
+    ExpansionTable() {}
+
+    explicit ExpansionTable(const vector<Pair>& grammar) {
+        offset.resize(grammar.size());
+        length.resize(grammar.size());
+        uint64_t total = 0;
+        for (Token i = 0; i < grammar.size(); i++) {
+            if (i >= 256 && (grammar[i].l >= i || grammar[i].r >= i)) {
+                throw invalid_argument("Grammar rule refers to a later rule");
+            }
+            length[i] = i < 256 ? 1 : length[grammar[i].l] + length[grammar[i].r];
+            offset[i] = total;
+            total += length[i];
+        }
+        bytes.resize(total);
+        for (Token i = 0; i < grammar.size(); i++) {
+            uint8_t* dst = bytes.data() + offset[i];
+            if (i < 256) {
+                *dst = i;
+                continue;
+            }
+            const Pair& rule = grammar[i];
+            copy_n(bytes.data() + offset[rule.l], length[rule.l], dst);
+            copy_n(bytes.data() + offset[rule.r], length[rule.r], dst + length[rule.l]);
+        }
+    }
+
+    size_t size() const {
+        return offset.size();
+    }
+
+    const uint8_t* data(Token t) const {
+        return bytes.data() + offset[t];
+    }
+};
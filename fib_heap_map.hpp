@@ -1,16 +1,20 @@
+#pragma once
 #include <iostream>
-#include <functional>
 #include <stdexcept>
-#include <sys/types.h>
-#include <unordered_map>
 #include <cstdint>
+#include <type_traits>
 #include <vector>
+#include "flat_hash_map.hpp"
+#include "heap_ops.hpp"
+#include "slab_pool.hpp"
+#include "telemetry.hpp"
 
 using namespace std;
 
 template <typename Data>
 struct FibHeapNode {
     Data data;
+    size_t priority; // cached key of data
     FibHeapNode<Data>* parent;
     FibHeapNode<Data>* child;
     FibHeapNode<Data>* left;
@@ -18,10 +22,11 @@ struct FibHeapNode {
     uint32_t degree;
     bool marked;
 
-    FibHeapNode(const Data& data) : data(data), parent(nullptr), child(nullptr), left(this), right(this), degree(0), marked(false) {}
+    FibHeapNode(const Data& data, size_t priority) : data(data), priority(priority), parent(nullptr), child(nullptr), left(this), right(this), degree(0), marked(false) {}
+
+    // inserts node to the left of this one in its circular sibling list
     void add_sibling(FibHeapNode<Data>* node) {
         if (!node) return;
-        // Update the pointers to add the sibling
         node->parent = this->parent; // inherit parent
         node->left = this->left;
         node->right = this;
@@ -31,202 +36,196 @@ struct FibHeapNode {
 
     void add_child(FibHeapNode<Data>* node) {
         if (!node) return;
-        // Update the pointers to add the child
         if (this->child) {
             this->child->add_sibling(node);
         }
         else {
+            node->left = node;
+            node->right = node;
             this->child = node;
-            node->parent = this;
         }
+        node->parent = this;
+        node->marked = false;
         this->degree++;
     }
 
+    // takes this node out of its sibling list, fixing up the parent's child pointer
+    void unlink() {
+        if (parent) {
+            if (parent->child == this) parent->child = (right == this) ? nullptr : right;
+            parent->degree--;
+        }
+        left->right = right;
+        right->left = left;
+        left = this;
+        right = this;
+        parent = nullptr;
+    }
 };
 
+// Max Fibonacci heap with a key -> node index. Increasing a key cuts the node
+// to the root list when it outgrows its parent (with cascading cuts), which
+// is O(1) amortized. Decreasing a key moves the node's children to the root
+// list instead, so only the node itself has to be compared again, and the
+// root list is consolidated when the max itself went down. Nodes come from a
+// SlabPool, so a pair appearing or vanishing does not reach the system
+// allocator and teardown drops whole slabs.
 template <typename K, typename V, typename Hasher, typename HeapKeyFunc>
 class FibHeapMap {
 private:
-    unordered_map<K, FibHeapNode<pair<K,V>>*, Hasher> map_;
+    typedef FibHeapNode<pair<K,V>> Node;
+
+    SlabPool<Node> pool_;
+    FlatHashMap<K, Node*, Hasher> map_;
     HeapKeyFunc keyFunc_;
-    uint32_t max_degree_;
-    FibHeapNode<pair<K,V>>* max_;
-    vector<FibHeapNode<pair<K,V>>*> aux_arr_;
-
-    FibHeapNode<pair<K,V>>* _max_sibling(FibHeapNode<pair<K,V>>* node) {
-        FibHeapNode<pair<K,V>>* curr = node;
-        uint32_t max_val = keyFunc_(curr->data);
-        auto max = curr;
-        do  {
-            if (keyFunc_(curr->right->data) > max_val) {
-                max_val = keyFunc_(curr->right->data);
-                max = curr->right;
+    Node* max_;
+    vector<Node*> aux_arr_; // roots by degree during consolidation
+    HeapOpCounts ops_;
+
+    size_t _key(const Node* node) const {
+        return node->priority;
+    }
+
+    void _add_root(Node* node) {
+        node->marked = false;
+        if (max_) {
+            max_->add_sibling(node);
+            node->parent = nullptr;
+            if (_key(node) > _key(max_)) max_ = node;
+        } else {
+            node->left = node;
+            node->right = node;
+            node->parent = nullptr;
+            max_ = node;
+        }
+    }
+
+    // cuts node to the root list, then the marked ancestors above it
+    void _cut(Node* node) {
+        Node* parent = node->parent;
+        node->unlink();
+        _add_root(node);
+        HEAP_OP(ops_, moves);
+        TELEMETRY_ADD(heap_cuts, 1);
+        while (parent && parent->parent) {
+            if (!parent->marked) {
+                parent->marked = true;
+                return;
             }
-            curr = curr->right;
-        } while (curr != node);
-        return max;
+            Node* next = parent->parent;
+            parent->unlink();
+            _add_root(parent);
+            HEAP_OP(ops_, moves);
+            TELEMETRY_ADD(heap_cuts, 1);
+            parent = next;
+        }
     }
 
-    void _merge(FibHeapNode<pair<K,V>>* node1, FibHeapNode<pair<K,V>>* node2) {
-        if (!node1 || !node2) return;
-        if (keyFunc_(node1->data) < keyFunc_(node2->data)) swap(node1, node2);
-        // take care of previous siblings
-        node1->right->left = node1->left;
-        node1->left->right = node1->right;
-        node2->add_child(node1); // this takes care of the degree
-        if (node2->degree > max_degree_) {
-            max_degree_ = node2->degree;
-            aux_arr_.push_back(nullptr);
+    // moves every child of node to the root list
+    void _promote_children(Node* node) {
+        while (node->child) {
+            Node* child = node->child;
+            child->unlink();
+            _add_root(child);
+            HEAP_OP(ops_, moves);
         }
     }
 
-    // called at the end of pop (extract min)
+    // links roots of equal degree until all degrees differ, and finds the max
     void _consolidate() {
-        FibHeapNode<pair<K,V>>* curr = max_;
-        if (!curr) return;
+        if (!max_) return;
+        TELEMETRY_ADD(consolidations, 1);
+        vector<Node*> roots;
+        Node* curr = max_;
         do {
-            FibHeapNode<pair<K,V>>* next = curr->right;
-            if (aux_arr_[curr->degree]) {
-                FibHeapNode<pair<K,V>>* aux = aux_arr_[curr->degree];
-                _merge(aux, curr);
-                aux_arr_[curr->degree] = nullptr;
-                curr = aux;
-            } else {
-                aux_arr_[curr->degree] = curr;
-                curr = next;
-            }
+            roots.push_back(curr);
+            curr = curr->right;
         } while (curr != max_);
+
+        for (Node* root : roots) {
+            root->left = root;
+            root->right = root;
+            while (true) {
+                if (root->degree >= aux_arr_.size()) aux_arr_.resize(root->degree + 1, nullptr);
+                Node* other = aux_arr_[root->degree];
+                if (!other) break;
+                aux_arr_[root->degree] = nullptr;
+                if (_key(other) > _key(root)) swap(root, other);
+                root->add_child(other);
+                HEAP_OP(ops_, moves);
+            }
+            aux_arr_[root->degree] = root;
+        }
+
+        max_ = nullptr;
+        for (Node*& root : aux_arr_) {
+            if (!root) continue;
+            _add_root(root);
+            root = nullptr;
+        }
     }
 
 public:
-    FibHeapMap(HeapKeyFunc keyFunc) {
-        keyFunc_ = keyFunc;
-        aux_arr_.push_back(nullptr);
-        max_degree_ = 0;
-        max_ = nullptr;
+    FibHeapMap(HeapKeyFunc keyFunc) : keyFunc_(keyFunc), max_(nullptr) {}
+
+    FibHeapMap(const FibHeapMap&) = delete;
+    FibHeapMap& operator=(const FibHeapMap&) = delete;
+
+    ~FibHeapMap() {
+        if constexpr (!is_trivially_destructible_v<Node>) {
+            for (auto& entry : map_) pool_.destroy(entry.second);
+        }
     }
 
-    ~FibHeapMap() = default;
+    void reserve(size_t n) {
+        map_.reserve(n);
+        pool_.reserve(n);
+    }
 
     void push(const K& key, const V& value) {
         if (map_.find(key) != map_.end()) return; // do not add duplicates.
-        FibHeapNode<pair<K,V>>* node = new FibHeapNode<pair<K,V>>(make_pair(key, value));
+        HEAP_OP(ops_, pushes);
+        Node* node = pool_.create(make_pair(key, value), 0);
+        node->priority = keyFunc_(node->data);
         map_[key] = node;
-        if (max_) {
-            max_->add_sibling(node);
-            if (keyFunc_(node->data) > keyFunc_(max_->data)) max_ = node;
-        }
-        else {
-            max_ = node;
-        }
+        _add_root(node);
     }
 
-    void update(const K& key, const function<void(V&)>& updateFunc) {
+    template <typename F>
+    const V& update(const K& key, F&& updateFunc) {
         auto it = map_.find(key);
-        if (it == map_.end()) throw std::runtime_error("Key not found");
-
-        FibHeapNode<pair<K,V>>* node = it->second;
-        uint32_t old_key_value = keyFunc_(node->data);
-
-        // Call the user-provided function to modify the value
+        if (it == map_.end()) throw runtime_error("Key not found");
+        HEAP_OP(ops_, updates);
+        Node* node = it->second;
+        size_t old_key = node->priority;
         updateFunc(node->data.second);
-
-        // Get the new key value after the update
-        uint32_t new_key_value = keyFunc_(node->data);
-
-        cout << "New key value: " << new_key_value << "old" << old_key_value << endl;
-
-        // Check if the key has increased or decreased
-        if (new_key_value < old_key_value) { // ?? here can we use the max of the children?
-            // Remove from parent
-            if (!node->parent) return;
-            if (!node->parent->marked) {
-                FibHeapNode<pair<K,V>>* parent = node->parent;
-                if (parent->child == node) {
-                    parent->child = (node->right == node) ? nullptr : node->right;
-                }
-                parent->degree--;
-                parent->marked = true; // the parent lost a child
-
-                // get rid of old sibling relation
-                node->left->right = node->right;
-                node->right->left = node->left;
-
-                // Add to the root list
-                max_->add_sibling(node);
-                return;
-            }
-            auto curr = node->parent;
-            do {
-                if (curr->parent->child == node) {
-                    curr->parent->child = (node->right == node) ? nullptr : node->right;
-                }
-                curr->parent->degree--;
-                // get rid of old sibling relation
-                curr->left->right = curr->right;
-                curr->right->left = curr->left;
-
-                // Add to the root list
-                max_->add_sibling(curr);
-                curr->marked = false;
-
-                // Move to the next parent
-                curr = curr->parent;
-            } while(curr->parent && curr->parent->marked);
-        } else if (new_key_value > old_key_value) {
-            // Key has increased
-            // We need to cut the node from its parent and add it to the root list
-            if (!node->parent || node->parent && new_key_value < keyFunc_(node->parent->data)) return; // nothing needs to be done
-            // Remove from parent
-            if (!node->parent->marked) {
-                FibHeapNode<pair<K,V>>* parent = node->parent;
-                if (parent->child == node) {
-                    parent->child = (node->right == node) ? nullptr : node->right;
-                }
-                parent->degree--;
-                parent->marked = true; // the parent lost a child
-
-                // get rid of old sibling relation
-                node->left->right = node->right;
-                node->right->left = node->left;
-
-                // Add to the root list
-                max_->add_sibling(node);
-                return;
-            }
-            auto curr = node->parent;
-            do {
-                if (curr->parent->child == node) {
-                    curr->parent->child = (node->right == node) ? nullptr : node->right;
-                }
-                curr->parent->degree--;
-                // get rid of old sibling relation
-                curr->left->right = curr->right;
-                curr->right->left = curr->left;
-
-                // Add to the root list
-                max_->add_sibling(curr);
-                curr->marked = false;
-
-                // Move to the next parent
-                curr = curr->parent;
-            } while(curr->parent && curr->parent->marked);
+        size_t new_key = node->priority = keyFunc_(node->data);
+
+        if (new_key > old_key) {
+            if (node->parent && new_key > _key(node->parent)) _cut(node);
+            if (new_key > _key(max_)) max_ = node;
+        } else if (new_key < old_key) {
+            // a promoted child can look like the new max; only a full pass knows
+            bool was_max = node == max_;
+            _promote_children(node);
+            if (was_max) _consolidate();
         }
+        return node->data.second;
     }
 
     const V& view(const K& key) {
-        if (map_.find(key) == map_.end()) throw std::runtime_error("Key not found");
-        return map_.at(key)->data.second;
+        auto it = map_.find(key);
+        if (it == map_.end()) throw runtime_error("Key not found");
+        return it->second->data.second;
     }
 
     pair<K, V> pop() {
-        if (!max_) throw runtime_error("Heap is empty");
-        auto ret = max_->data;
-        erase(max_->data.first); // this is kind of lazy
-        return ret;
+        if (!max_) throw runtime_error("The heap is empty.");
+        return erase(max_->data.first);
     }
 
     const pair<K, V>& max() const {
+        if (!max_) throw runtime_error("The heap is empty.");
         return max_->data;
     }
 
@@ -240,50 +239,63 @@ public:
 
     pair<K, V> erase(K map_key) {
         auto it = map_.find(map_key);
-        if (it == map_.end()) throw std::runtime_error("Key not found");
-
-        FibHeapNode<pair<K,V>>* node = it->second;
-        auto ret = node->data;
-
-        // If the node is the max node, we need to update max_
-        // Remove the node from its siblings
-        node->left->right = node->right;
-        node->right->left = node->left;
-
-        // If the node has a parent, we need to remove it from the parent's child list
-        if (node->parent) {
-            node->parent->degree--;
-            node->parent->marked = true; // the parent lost a child
-            if (node->parent->child == node) {
-                node->parent->child = (node->right == node) ? nullptr : node->right;
-            }
+        if (it == map_.end()) throw runtime_error("Key not found");
+        HEAP_OP(ops_, erases);
+        Node* node = it->second;
+        map_.erase(it);
+
+        bool was_max = node == max_;
+        if (node->parent) _cut(node);
+        _promote_children(node);
+        if (was_max) max_ = (node->right == node) ? nullptr : node->right;
+        node->unlink();
+        if (was_max) _consolidate();
+
+        pair<K, V> ret = std::move(node->data);
+        pool_.destroy(node);
+        return ret;
+    }
+
+    const HeapOpCounts& ops() const {
+        return ops_;
+    }
+
+    class ConstIterator {
+    public:
+        typedef typename FlatHashMap<K, Node*, Hasher>::const_iterator Inner;
+
+        ConstIterator(Inner it) : it_(it) {}
+
+        const pair<K, V>& operator*() const {
+            return it_->second->data;
         }
-        // Add the children of the deleted node to the root list
-        if (node->child) {
-            // Connect the children to the root list
-            FibHeapNode<pair<K,V>>* child = node->child;
-
-            // Connect the last child to the root list
-            FibHeapNode<pair<K,V>>* last_child = child->left; // last child in the child list
-
-            // Connect the last child's right to the current max's left
-            last_child->right = max_->left;
-            max_->left->right = child; // Connect the first child to the current max's left
-            child->left = last_child; // Connect the first child to the last child
-            max_->left = last_child; // Update the max's left to the last child
-
-            // Set parent pointers of children to nullptr
-            child->parent = nullptr;
-            for (FibHeapNode<pair<K,V>>* curr = child; curr != last_child; curr = curr->right) {
-                curr->parent = nullptr; // Remove parent reference
-            }
+
+        const pair<K, V>* operator->() const {
+            return &it_->second->data;
         }
-        // Clean up the node
-        map_.erase(it);
-        delete node;
 
-        _consolidate();
-        // Return the erased data
-        return ret; // Return the key and the value that was set to zero
+        ConstIterator& operator++() {
+            ++it_;
+            return *this;
+        }
+
+        bool operator==(const ConstIterator& other) const {
+            return it_ == other.it_;
+        }
+
+        bool operator!=(const ConstIterator& other) const {
+            return it_ != other.it_;
+        }
+
+    private:
+        Inner it_;
+    };
+
+    ConstIterator begin() const {
+        return ConstIterator(map_.begin());
+    }
+
+    ConstIterator end() const {
+        return ConstIterator(map_.end());
     }
 };
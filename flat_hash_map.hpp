@@ -0,0 +1,213 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Open-addressing hash map with Robin Hood probing, for small keys and values
+// (the priority maps' key -> node index). Entries live inline in one
+// power-of-two array of slots, each holding its distance from its home slot
+// plus one (0 marks an empty slot). An insert displaces any entry that sits
+// closer to its home than the new one would, which bounds probe lengths and
+// lets a lookup stop at the first slot with a shorter distance. Erase shifts
+// the following entries back by one instead of leaving a tombstone, so a
+// table under constant insert/erase churn never degrades.
+//
+// K and V must be default constructible. Any insert or erase invalidates
+// iterators and references, and Hasher must mix its bits well, since the slot
+// is taken from the low bits of the hash.
+template <typename K, typename V, typename Hasher>
+class FlatHashMap {
+public:
+    typedef pair<K, V> value_type;
+
+private:
+    static constexpr size_t MIN_CAPACITY = 16;
+
+    struct Slot {
+        value_type kv;
+        uint32_t dist;
+    };
+
+    vector<Slot> slots_;
+    size_t mask_;
+    size_t size_;
+    Hasher hash_;
+
+    // slot holding key, or slots_.size()
+    size_t _find(const K& key) const {
+        if (size_ == 0) return slots_.size();
+        size_t i = hash_(key) & mask_;
+        for (uint32_t dist = 1;; dist++) {
+            const Slot& slot = slots_[i];
+            if (slot.dist < dist) return slots_.size();
+            if (slot.dist == dist && slot.kv.first == key) return i;
+            i = (i + 1) & mask_;
+        }
+    }
+
+    // inserts a key that is not in the table and returns its slot
+    size_t _insert(value_type&& kv) {
+        Slot cur{std::move(kv), 1};
+        size_t i = hash_(cur.kv.first) & mask_;
+        size_t placed = slots_.size();
+        while (true) {
+            Slot& slot = slots_[i];
+            if (slot.dist == 0) {
+                slot = std::move(cur);
+                return placed == slots_.size() ? i : placed;
+            }
+            if (slot.dist < cur.dist) {
+                swap(slot, cur);
+                if (placed == slots_.size()) placed = i;
+            }
+            i = (i + 1) & mask_;
+            cur.dist++;
+        }
+    }
+
+    void _rehash(size_t capacity) {
+        vector<Slot> old(capacity);
+        old.swap(slots_);
+        mask_ = capacity - 1;
+        for (Slot& slot : old) {
+            if (slot.dist) _insert(std::move(slot.kv));
+        }
+    }
+
+    // grows so that n entries stay under a 7/8 load factor
+    void _fit(size_t n) {
+        size_t capacity = slots_.empty() ? MIN_CAPACITY : slots_.size();
+        while (n * 8 > capacity * 7) capacity *= 2;
+        if (capacity != slots_.size()) _rehash(capacity);
+    }
+
+    void _erase_slot(size_t i) {
+        size_t next = (i + 1) & mask_;
+        while (slots_[next].dist > 1) {
+            slots_[i].kv = std::move(slots_[next].kv);
+            slots_[i].dist = slots_[next].dist - 1;
+            i = next;
+            next = (next + 1) & mask_;
+        }
+        slots_[i].kv = value_type();
+        slots_[i].dist = 0;
+        size_--;
+    }
+
+    template <bool Const>
+    class Iter {
+    public:
+        typedef conditional_t<Const, const Slot*, Slot*> SlotPtr;
+        typedef conditional_t<Const, const value_type, value_type> Value;
+
+        Iter(SlotPtr slot, SlotPtr end) : slot_(slot), end_(end) { _skip(); }
+
+        Value& operator*() const {
+            return slot_->kv;
+        }
+
+        Value* operator->() const {
+            return &slot_->kv;
+        }
+
+        Iter& operator++() {
+            ++slot_;
+            _skip();
+            return *this;
+        }
+
+        bool operator==(const Iter& other) const {
+            return slot_ == other.slot_;
+        }
+
+        bool operator!=(const Iter& other) const {
+            return slot_ != other.slot_;
+        }
+
+    private:
+        friend class FlatHashMap;
+        SlotPtr slot_;
+        SlotPtr end_;
+
+        void _skip() {
+            while (slot_ != end_ && slot_->dist == 0) ++slot_;
+        }
+    };
+
+public:
+    typedef Iter<false> iterator;
+    typedef Iter<true> const_iterator;
+
+    FlatHashMap() : mask_(0), size_(0) {}
+
+    void reserve(size_t n) {
+        _fit(n);
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    void clear() {
+        slots_.clear();
+        mask_ = 0;
+        size_ = 0;
+    }
+
+    iterator find(const K& key) {
+        Slot* base = slots_.data();
+        return iterator(base + _find(key), base + slots_.size());
+    }
+
+    const_iterator find(const K& key) const {
+        const Slot* base = slots_.data();
+        return const_iterator(base + _find(key), base + slots_.size());
+    }
+
+    size_t count(const K& key) const {
+        return _find(key) != slots_.size();
+    }
+
+    V& operator[](const K& key) {
+        size_t i = _find(key);
+        if (i != slots_.size()) return slots_[i].kv.second;
+        _fit(size_ + 1);
+        size_++;
+        return slots_[_insert(value_type(key, V()))].kv.second;
+    }
+
+    void erase(iterator it) {
+        _erase_slot(it.slot_ - slots_.data());
+    }
+
+    size_t erase(const K& key) {
+        size_t i = _find(key);
+        if (i == slots_.size()) return 0;
+        _erase_slot(i);
+        return 1;
+    }
+
+    iterator begin() {
+        return iterator(slots_.data(), slots_.data() + slots_.size());
+    }
+
+    iterator end() {
+        return iterator(slots_.data() + slots_.size(), slots_.data() + slots_.size());
+    }
+
+    const_iterator begin() const {
+        return const_iterator(slots_.data(), slots_.data() + slots_.size());
+    }
+
+    const_iterator end() const {
+        return const_iterator(slots_.data() + slots_.size(), slots_.data() + slots_.size());
+    }
+};
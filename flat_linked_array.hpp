@@ -0,0 +1,150 @@
+#pragma once
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+// Structure-of-arrays version of LinkedArray: tokens and their neighbour links
+// live in three contiguous arrays instead of one heap node per element, which
+// brings the cost down to 12 bytes per uint32_t token. Removed slots keep their
+// index but hold Tombstone, and a missing neighbour is npos instead of nullptr.
+template <typename T, T Tombstone = numeric_limits<T>::max()>
+class FlatLinkedArray {
+public:
+    static constexpr uint32_t npos = UINT32_MAX;
+
+private:
+    vector<T> tokens;
+    vector<uint32_t> next;
+    vector<uint32_t> prev;
+    size_t length;
+
+public:
+    FlatLinkedArray() : length(0) {}
+
+    void fill(const vector<T>& data) {
+        fill(data.data(), data.size());
+    }
+
+    // builds the sequence straight from any buffer whose elements convert to T
+    template <typename U>
+    void fill(const U* data, size_t size) {
+        if (size >= npos) throw length_error("FlatLinkedArray is limited to 2^32 - 1 elements");
+        tokens.resize(size);
+        next.resize(size);
+        prev.resize(size);
+        for (size_t i = 0; i < size; ++i) {
+            tokens[i] = data[i];
+            next[i] = (i + 1 < size) ? i + 1 : npos;
+            prev[i] = (i > 0) ? i - 1 : npos;
+        }
+        length = size;
+    }
+
+    bool exists(size_t index) const {
+        return index < tokens.size() && tokens[index] != Tombstone;
+    }
+
+    T get_by_index(size_t index) const {
+        if (!exists(index)) throw out_of_range("Index out of range");
+        return tokens[index];
+    }
+
+    T operator[](size_t index) const {
+        return tokens[index];
+    }
+
+    // neighbour indices of a live slot, npos at either end of the sequence
+    uint32_t get_prev_index(size_t index) const {
+        return prev[index];
+    }
+
+    uint32_t get_next_index(size_t index) const {
+        return next[index];
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    size_t capacity() const {
+        return tokens.size();
+    }
+
+    // merges the element at index with its successor, which becomes a tombstone
+    void replace_pair(size_t index, T new_item) {
+        if (!exists(index) || next[index] == npos) {
+            throw out_of_range("Index out of range");
+        }
+        merge_successor(index, new_item);
+        length--;
+    }
+
+    // replace_pair without the size bookkeeping. It only writes the slots of
+    // index, its successor and the element after that, so threads working on
+    // disjoint index ranges may call it concurrently and settle up with shrink().
+    void merge_successor(size_t index, T new_item) {
+        uint32_t removed = next[index];
+        tokens[index] = new_item;
+        next[index] = next[removed];
+        if (next[index] != npos) {
+            prev[next[index]] = index;
+        }
+        tokens[removed] = Tombstone;
+        next[removed] = npos;
+        prev[removed] = npos;
+    }
+
+    void shrink(size_t removed) {
+        length -= removed;
+    }
+
+    class Iterator {
+    public:
+        Iterator(FlatLinkedArray* arr, uint32_t index) : arr(arr), current(index) {}
+
+        Iterator& operator++() {
+            if (current == npos) throw out_of_range("Iterator out of range");
+            current = arr->next[current];
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator temp = *this;
+            ++(*this);
+            return temp;
+        }
+
+        T& operator*() {
+            if (current == npos) throw out_of_range("Iterator out of range");
+            return arr->tokens[current];
+        }
+
+        uint32_t index() const {
+            return current;
+        }
+
+        bool operator==(const Iterator& other) const {
+            return current == other.current;
+        }
+
+        bool operator!=(const Iterator& other) const {
+            return !(*this == other);
+        }
+
+    private:
+        FlatLinkedArray* arr;
+        uint32_t current;
+    };
+
+    // slot 0 is never removed because replace_pair only tombstones successors
+    Iterator begin() {
+        return Iterator(this, tokens.empty() ? npos : 0);
+    }
+
+    Iterator end() {
+        return Iterator(this, npos);
+    }
+};
@@ -1,30 +1,51 @@
+#pragma once
 #include <stdexcept>
-#include <unordered_map>
 #include <vector>
 #include <iostream>
-#include <functional>
+#include <utility>
+#include "flat_hash_map.hpp"
+#include "heap_ops.hpp"
 
 using namespace std;
 
+// Binary max heap with a key -> index map. The priority of every entry is
+// cached in prio_ next to heap_, so sifting compares plain integers instead
+// of calling keyFunc_ again; it is only recomputed when an entry changes.
 template <typename K, typename V, typename Hasher, typename HeapKeyFunc>
 class HeapMap {
 public:
     HeapMap(HeapKeyFunc keyFunc) : keyFunc_(keyFunc) {};
     ~HeapMap() = default;
 
+    void reserve(size_t n) {
+        map_.reserve(n);
+        heap_.reserve(n);
+        prio_.reserve(n);
+    }
+
     void push(const K& key, const V& value) {
-        heap_.push_back({key, value});
         if (map_.find(key) != map_.end()) throw runtime_error("Key already exists");
+        HEAP_OP(ops_, pushes);
+        heap_.push_back({key, value});
+        prio_.push_back(keyFunc_(heap_.back()));
         map_[key] = heap_.size() - 1;
         _heapify_up(heap_.size() - 1);
     }
 
-    void update(const K& key, const function<void(V&)>& updateFunc) {
-        if (map_.find(key) == map_.end()) throw runtime_error("Key does not exist");
-        size_t heap_i = map_[key];
+    // applies updateFunc to the value of key and returns it once the heap is
+    // restored
+    template <typename F>
+    const V& update(const K& key, F&& updateFunc) {
+        auto it = map_.find(key);
+        if (it == map_.end()) throw runtime_error("Key does not exist");
+        HEAP_OP(ops_, updates);
+        size_t heap_i = it->second;
         updateFunc(heap_[heap_i].second);
-        _heapify_up(heap_i);
-        _heapify_down(heap_i);
+        size_t old_prio = prio_[heap_i];
+        prio_[heap_i] = keyFunc_(heap_[heap_i]);
+        if (prio_[heap_i] > old_prio) heap_i = _heapify_up(heap_i);
+        else if (prio_[heap_i] < old_prio) heap_i = _heapify_down(heap_i);
+        return heap_[heap_i].second;
     }
 
     const V& view(const K& key) {
@@ -35,10 +56,11 @@ public:
     pair<K, V> pop() {
         if (heap_.size() == 0) throw runtime_error("The heap is empty.");
         _swap(0, heap_.size() - 1);
-        pair<K, V> item = heap_.back();
+        pair<K, V> item = std::move(heap_.back());
         heap_.pop_back();
+        prio_.pop_back();
         map_.erase(item.first);
-        _heapify_down(0);
+        if (!heap_.empty()) _heapify_down(0);
         return item;
     }
 
@@ -57,11 +79,14 @@ public:
     }
 
     pair<K, V> erase(K map_key) {
-        if (map_.find(map_key) == map_.end()) throw runtime_error("Invalid map key");
-        size_t heap_i = map_[map_key];
-        pair<K, V> item = heap_[heap_i];
+        auto it = map_.find(map_key);
+        if (it == map_.end()) throw runtime_error("Invalid map key");
+        HEAP_OP(ops_, erases);
+        size_t heap_i = it->second;
         _swap(heap_i, heap_.size() - 1);
+        pair<K, V> item = std::move(heap_.back());
         heap_.pop_back();
+        prio_.pop_back();
         map_.erase(map_key);
 
         if (heap_i < heap_.size()) {
@@ -71,17 +96,25 @@ public:
 
         return item;
     }
+
+    const HeapOpCounts& ops() const {
+        return ops_;
+    }
+
 private:
     HeapKeyFunc keyFunc_;
-    unordered_map<K, size_t, Hasher> map_; // keeps track of indices in heap
+    FlatHashMap<K, size_t, Hasher> map_; // keeps track of indices in heap
     vector<pair<K, V>> heap_;
+    vector<size_t> prio_; // keyFunc_(heap_[i]), kept in step with heap_
+    HeapOpCounts ops_;
 
     void _swap(size_t i, size_t j) {
+        if (i == j) return;
+        HEAP_OP(ops_, moves);
         map_[heap_[i].first] = j;
         map_[heap_[j].first] = i;
-        pair<K, V> temp = heap_[i];
-        heap_[i] = heap_[j];
-        heap_[j] = temp;
+        swap(heap_[i], heap_[j]);
+        swap(prio_[i], prio_[j]);
     }
 
     inline size_t _right_child(size_t i) {
@@ -96,27 +129,30 @@ private:
         return (i - 1) / 2;
     }
 
-    void _heapify_down(size_t i) {
-        size_t largest = i;
-        size_t left = _left_child(i);
-        size_t right = _right_child(i);
-        if (left < heap_.size() && keyFunc_(heap_[left]) > keyFunc_(heap_[largest])) {
-            largest = left;
-        }
-        if (right < heap_.size() && keyFunc_(heap_[right]) > keyFunc_(heap_[largest])) {
-            largest = right;
-        }
-        if (largest != i) {
+    // both return the index the entry ended up at
+    size_t _heapify_down(size_t i) {
+        while (true) {
+            size_t largest = i;
+            size_t left = _left_child(i);
+            size_t right = _right_child(i);
+            if (left < heap_.size() && prio_[left] > prio_[largest]) {
+                largest = left;
+            }
+            if (right < heap_.size() && prio_[right] > prio_[largest]) {
+                largest = right;
+            }
+            if (largest == i) return i;
             _swap(i, largest);
-            _heapify_down(largest);
+            i = largest;
         }
     }
 
-    void _heapify_up(size_t i) {
-        while (i > 0 && keyFunc_(heap_[i]) > keyFunc_(heap_[_parent(i)])) {
+    size_t _heapify_up(size_t i) {
+        while (i > 0 && prio_[i] > prio_[_parent(i)]) {
             _swap(i, _parent(i));
             i = _parent(i);
         }
+        return i;
     }
 
 public:
@@ -0,0 +1,27 @@
+#pragma once
+#include <cstdint>
+#include <iostream>
+
+using namespace std;
+
+// Operation counts kept by the priority maps when built with -DHEAP_OP_COUNTS,
+// for comparing backends. moves counts the structural work behind the calls:
+// swaps in a binary heap, links and cuts in a Fibonacci or pairing heap,
+// bucket relinks in a bucket queue.
+struct HeapOpCounts {
+    uint64_t pushes = 0;
+    uint64_t updates = 0;
+    uint64_t erases = 0;
+    uint64_t moves = 0;
+
+    friend ostream& operator<<(ostream& os, const HeapOpCounts& c) {
+        os << "pushes " << c.pushes << " updates " << c.updates << " erases " << c.erases << " moves " << c.moves;
+        return os;
+    }
+};
+
+#ifdef HEAP_OP_COUNTS
+#define HEAP_OP(counts, op) ((counts).op++)
+#else
+#define HEAP_OP(counts, op) ((void)0)
+#endif
@@ -1,5 +1,9 @@
+#pragma once
 #include <iostream>
+#include <stdexcept>
+#include <type_traits>
 #include <vector>
+#include "slab_pool.hpp"
 
 using namespace std;
 
@@ -11,18 +15,23 @@ struct Node {
     T data;
 };
 
+// Nodes are allocated from a SlabPool sized for the whole input, so fill()
+// makes a single allocation and the destructor releases it in one go.
 template <typename T>
 class LinkedArray {
 private:
+    SlabPool<Node<T>> pool;
     vector<Node<T>*> nodes;
 
 public:
     size_t length;
     void fill(const vector<T>& data) {
         Node<T>* prev = nullptr;
+        pool.reserve(data.size());
+        nodes.reserve(nodes.size() + data.size());
         for (size_t i = 0; i < data.size(); ++i) {
             T newdata = data[i];
-            Node<T>* newNode = new Node<T>{nullptr, prev, i, newdata};
+            Node<T>* newNode = pool.create(Node<T>{nullptr, prev, i, newdata});
             if (prev) prev->next = newNode;
             nodes.push_back(newNode);
             prev = newNode;
@@ -30,10 +39,13 @@ public:
         length = data.size();
     }
     LinkedArray() {}
+    LinkedArray(const LinkedArray&) = delete;
+    LinkedArray& operator=(const LinkedArray&) = delete;
     ~LinkedArray() {
-        cout << "LinkedArray destructor called " << nodes.size()<< endl;
-        for (auto node : nodes) {
-            if (node != nullptr) delete node;
+        if constexpr (!is_trivially_destructible_v<Node<T>>) {
+            for (auto node : nodes) {
+                if (node != nullptr) pool.destroy(node);
+            }
         }
     }
 
@@ -83,8 +95,10 @@ public:
             throw out_of_range("Index out of range");
         }
         nodes[index]->data = new_item;
-        nodes[nodes[index]->next->index] = nullptr;
-        nodes[index]->next = nodes[index]->next->next;
+        Node<T>* removed = nodes[index]->next;
+        nodes[removed->index] = nullptr;
+        nodes[index]->next = removed->next;
+        pool.destroy(removed);
         if (nodes[index]->next != nullptr) {
             nodes[index]->next->prev = nodes[index];
         }
@@ -0,0 +1,77 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+// Read-only view of a whole file through mmap, so a corpus can be tokenized
+// straight from the page cache without first copying it into a buffer. On
+// failure the error is printed, the view is left empty and ok() is false; an
+// empty file is a valid empty view with a null data().
+// advice is passed to madvise; the default suits a single front to back pass.
+class MappedFile {
+private:
+    const unsigned char* data_;
+    size_t size_;
+    bool ok_;
+
+public:
+    MappedFile(const string& filename, int advice = MADV_SEQUENTIAL) : data_(nullptr), size_(0), ok_(false) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            cerr << "Error opening file: " << filename << ": " << strerror(errno) << endl;
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            cerr << "Error reading file: " << filename << ": " << strerror(errno) << endl;
+            ::close(fd);
+            return;
+        }
+        if (st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                cerr << "Error mapping file: " << filename << ": " << strerror(errno) << endl;
+            } else {
+                madvise(p, st.st_size, advice);
+                data_ = static_cast<const unsigned char*>(p);
+                size_ = st.st_size;
+                ok_ = true;
+            }
+        } else {
+            ok_ = true;
+        }
+        ::close(fd); // the mapping keeps its own reference
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    void close() {
+        if (data_) munmap(const_cast<unsigned char*>(data_), size_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    bool ok() const {
+        return ok_;
+    }
+
+    const unsigned char* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+};
@@ -0,0 +1,103 @@
+#pragma once
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+// Shared storage for the position lists of every pair. A list is a chain of
+// fixed-size blocks addressed by index, so lists never own heap nodes and the
+// pool can grow without invalidating a chain being walked. Positions are never
+// removed one by one: callers invalidate them lazily by re-checking the tokens
+// at a position before using it, and hand whole chains back with release().
+class OccurrencePool {
+public:
+    static constexpr uint32_t NIL = UINT32_MAX;
+    static constexpr uint32_t BLOCK_SIZE = 6;
+
+private:
+    struct Block {
+        uint32_t next;
+        uint32_t used;
+        uint32_t positions[BLOCK_SIZE];
+    };
+
+    vector<Block> blocks_;
+    uint32_t free_; // singly linked through Block::next
+
+    uint32_t _alloc(uint32_t next) {
+        uint32_t b;
+        if (free_ != NIL) {
+            b = free_;
+            free_ = blocks_[b].next;
+        } else {
+            b = blocks_.size();
+            blocks_.emplace_back();
+        }
+        blocks_[b].next = next;
+        blocks_[b].used = 0;
+        return b;
+    }
+
+public:
+    OccurrencePool() : free_(NIL) {}
+
+    // appends a position to the chain starting at head and returns the new head
+    uint32_t push(uint32_t head, uint32_t position) {
+        if (head == NIL || blocks_[head].used == BLOCK_SIZE) {
+            head = _alloc(head);
+        }
+        Block& b = blocks_[head];
+        b.positions[b.used++] = position;
+        return head;
+    }
+
+    // reserves a chain for n positions on fresh blocks. The chain is filled
+    // later with fill_chain, which never allocates and so may run on several
+    // threads at once for different chains.
+    uint32_t alloc_chain(size_t n) {
+        size_t count = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint32_t head = blocks_.size();
+        blocks_.resize(blocks_.size() + count);
+        for (size_t k = 0; k < count; ++k) {
+            blocks_[head + k].next = (k + 1 < count) ? head + k + 1 : NIL;
+            blocks_[head + k].used = 0;
+        }
+        return count ? head : NIL;
+    }
+
+    // the head block takes the remainder so later push() calls can top it up
+    void fill_chain(uint32_t head, const uint32_t* positions, size_t n) {
+        size_t first = n % BLOCK_SIZE ? n % BLOCK_SIZE : BLOCK_SIZE;
+        for (uint32_t b = head; b != NIL; b = blocks_[b].next) {
+            size_t take = (b == head) ? first : BLOCK_SIZE;
+            copy(positions, positions + take, blocks_[b].positions);
+            blocks_[b].used = take;
+            positions += take;
+        }
+    }
+
+    void release(uint32_t head) {
+        while (head != NIL) {
+            uint32_t next = blocks_[head].next;
+            blocks_[head].next = free_;
+            free_ = head;
+            head = next;
+        }
+    }
+
+    // calls f(position) for every entry of a chain, stale ones included. The
+    // walk is index based, so f may push onto other chains while it runs.
+    template <typename F>
+    void for_each(uint32_t head, F f) {
+        for (uint32_t b = head; b != NIL; b = blocks_[b].next) {
+            for (uint32_t k = 0; k < blocks_[b].used; ++k) {
+                f(blocks_[b].positions[k]);
+            }
+        }
+    }
+
+    size_t bytes() const {
+        return blocks_.capacity() * sizeof(Block);
+    }
+};
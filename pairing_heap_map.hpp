@@ -1,114 +1,241 @@
-#include <functional>
+#pragma once
+#include <cstdint>
 #include <stdexcept>
-#include <unordered_map>
+#include <vector>
+#include "flat_hash_map.hpp"
+#include "heap_ops.hpp"
+#include "telemetry.hpp"
 
 using namespace std;
 
 template<typename K, typename V>
 struct PairingHeapNode {
     pair<K, V> data;
-    PairingHeapNode* leftChild;
-    PairingHeapNode* nextSibling;
-
-    PairingHeapNode():
-            leftChild(nullptr), nextSibling(nullptr) {}
-
-    // creates a new node
-    PairingHeapNode(pair<K, V> data_, PairingHeapNode *leftChild_, PairingHeapNode *nextSibling_):
-        data(data_), leftChild(leftChild_), nextSibling(nextSibling_) {}
-
-    // Adds a child and sibling to the node
-    void addChild(PairingHeapNode *node) {
-        if(leftChild == nullptr)
-            leftChild = node;
-        else {
-            node->nextSibling = leftChild;
-            leftChild = node;
-        }
-    }
+    size_t priority; // cached key of data
+    uint32_t leftChild;
+    uint32_t nextSibling;
+    uint32_t prev; // previous sibling, or the parent for a first child
+    bool live;
 };
 
+// Addressable max pairing heap. Nodes live in one pooled vector and link to
+// each other by index, erased slots are reused, and map_ takes a key to its
+// slot. Changing a key cuts the node's subtree out and melds it back in at
+// the root; a decrease also splits off the node's children first, since they
+// may now outrank it. Removing the max merges the root's children in two
+// passes (pairs left to right, then right to left), iteratively so that a
+// long root list cannot overflow the stack.
 template <typename K, typename V, typename Hasher, typename HeapKeyFunc>
 class PairingHeapMap {
 private:
-    unordered_map<K, V> map_;
+    static constexpr uint32_t NIL = UINT32_MAX;
+    typedef PairingHeapNode<K, V> Node;
+
+    FlatHashMap<K, uint32_t, Hasher> map_;
+    vector<Node> nodes_;
+    vector<uint32_t> free_;
+    vector<uint32_t> pass_; // scratch for _two_pass_merge
     HeapKeyFunc keyFunc_;
-    PairingHeapNode<K, V>* root;
-
-    PairingHeapNode<K, V>* merge_(PairingHeapNode<K,V>* a, PairingHeapNode<K,V>* b) {
-        // If any of the two-nodes is null
-        // the return the not null node
-        if(a == nullptr) return b;
-        if(b == nullptr) return a;
-
-        // To maintain the max heap condition compare
-        // the nodes and node with minimum value become
-        // parent of the other node
-        if(keyFunc_(a->key) > keyFunc_(b->key)) {
-            a->addChild(b);
-            return a;
-        }
-        else {
-            b->addChild(a);
-            return b;
-        }
+    uint32_t root_;
+    HeapOpCounts ops_;
 
-        return nullptr; // Unreachable
+    size_t _key(uint32_t n) const {
+        return nodes_[n].priority;
     }
-    // This method is used when we want to delete root node
-    PairingHeapNode<K,V> *twopassmerge_(PairingHeapNode<K,V> *node) {
-        if(node == nullptr || node->nextSibling == nullptr)
-            return node;
-        else {
-            PairingHeapNode<K,V> *a, *b, *newNode;
-            a = node;
-            b = node->nextSibling;
-            newNode = node->nextSibling->nextSibling;
 
-            a->nextSibling = nullptr;
-            b->nextSibling = nullptr;
+    // melds two detached trees and returns the new root
+    uint32_t _merge(uint32_t a, uint32_t b) {
+        if (a == NIL) return b;
+        if (b == NIL) return a;
+        HEAP_OP(ops_, moves);
+        if (_key(b) > _key(a)) swap(a, b);
+        // b becomes the first child of a
+        nodes_[b].nextSibling = nodes_[a].leftChild;
+        if (nodes_[a].leftChild != NIL) nodes_[nodes_[a].leftChild].prev = b;
+        nodes_[b].prev = a;
+        nodes_[a].leftChild = b;
+        nodes_[a].nextSibling = NIL;
+        nodes_[a].prev = NIL;
+        return a;
+    }
 
-            return merge_(merge_(a, b), twopassmerge_(newNode));
-        }
+    // detaches the subtree rooted at n from its parent and siblings
+    void _cut(uint32_t n) {
+        Node& node = nodes_[n];
+        if (node.prev == NIL) return; // the root
+        HEAP_OP(ops_, moves);
+        TELEMETRY_ADD(heap_cuts, 1);
+        if (nodes_[node.prev].leftChild == n) nodes_[node.prev].leftChild = node.nextSibling;
+        else nodes_[node.prev].nextSibling = node.nextSibling;
+        if (node.nextSibling != NIL) nodes_[node.nextSibling].prev = node.prev;
+        node.prev = NIL;
+        node.nextSibling = NIL;
+    }
 
-        return nullptr; // Unreachable
+    // merges a sibling list (starting at first) into one tree
+    uint32_t _two_pass_merge(uint32_t first) {
+        pass_.clear();
+        while (first != NIL) {
+            uint32_t a = first;
+            uint32_t b = nodes_[a].nextSibling;
+            first = b == NIL ? NIL : nodes_[b].nextSibling;
+            nodes_[a].nextSibling = nodes_[a].prev = NIL;
+            if (b != NIL) nodes_[b].nextSibling = nodes_[b].prev = NIL;
+            pass_.push_back(_merge(a, b));
+        }
+        uint32_t result = NIL;
+        for (size_t i = pass_.size(); i-- > 0;) {
+            result = _merge(pass_[i], result);
+        }
+        return result;
     }
 
-    // Function to delete the root node in heap
-    PairingHeapNode<K,V> *remove_(PairingHeapNode<K,V> *node) {
-        return twopassmerge_(node->leftChild);
+    // detaches the children of n and returns them merged into one tree
+    uint32_t _take_children(uint32_t n) {
+        uint32_t first = nodes_[n].leftChild;
+        nodes_[n].leftChild = NIL;
+        return _two_pass_merge(first);
     }
+
 public:
-    PairingHeapMap(HeapKeyFunc keyFunc) : keyFunc_(keyFunc) {};
+    PairingHeapMap(HeapKeyFunc keyFunc) : keyFunc_(keyFunc), root_(NIL) {}
     ~PairingHeapMap() = default;
 
+    void reserve(size_t n) {
+        map_.reserve(n);
+        nodes_.reserve(n);
+    }
+
     void push(const K& key, const V& value) {
-        merge_(root, new PairingHeapNode<K, V>(make_pair(key, value), nullptr, nullptr));
+        if (map_.find(key) != map_.end()) return; // do not add duplicates.
+        HEAP_OP(ops_, pushes);
+        uint32_t n;
+        if (!free_.empty()) {
+            n = free_.back();
+            free_.pop_back();
+            nodes_[n] = Node{make_pair(key, value), 0, NIL, NIL, NIL, true};
+        } else {
+            n = nodes_.size();
+            nodes_.push_back(Node{make_pair(key, value), 0, NIL, NIL, NIL, true});
+        }
+        nodes_[n].priority = keyFunc_(nodes_[n].data);
+        map_[key] = n;
+        root_ = _merge(root_, n);
     }
 
-    void update(const K& key, const function<void(V&)>& updateFunc) {
+    template <typename F>
+    const V& update(const K& key, F&& updateFunc) {
+        auto it = map_.find(key);
+        if (it == map_.end()) throw runtime_error("Key not found");
+        HEAP_OP(ops_, updates);
+        uint32_t n = it->second;
+        size_t old_key = nodes_[n].priority;
+        updateFunc(nodes_[n].data.second);
+        size_t new_key = nodes_[n].priority = keyFunc_(nodes_[n].data);
+
+        if (new_key > old_key) {
+            if (n != root_) {
+                _cut(n);
+                root_ = _merge(root_, n);
+            }
+        } else if (new_key < old_key) {
+            uint32_t children = _take_children(n);
+            if (n == root_) {
+                root_ = _merge(n, children);
+            } else {
+                _cut(n);
+                root_ = _merge(_merge(root_, children), n);
+            }
+        }
+        return nodes_[n].data.second;
     }
 
     const V& view(const K& key) {
+        auto it = map_.find(key);
+        if (it == map_.end()) throw runtime_error("Key not found");
+        return nodes_[it->second].data.second;
     }
 
     pair<K, V> pop() {
-        pair<K,V> top = max();
-        remove_(root);
-        return top;
+        if (root_ == NIL) throw runtime_error("The heap is empty.");
+        return erase(nodes_[root_].data.first);
     }
 
     const pair<K, V>& max() const {
-        if (root == nullptr) throw runtime_error("Cannot view the top of empty");
-        return root->key;
+        if (root_ == NIL) throw runtime_error("The heap is empty.");
+        return nodes_[root_].data;
     }
 
     bool contains(K key) const {
+        return map_.find(key) != map_.end();
     }
 
     size_t size() const {
+        return map_.size();
     }
 
     pair<K, V> erase(K map_key) {
+        auto it = map_.find(map_key);
+        if (it == map_.end()) throw runtime_error("Key not found");
+        HEAP_OP(ops_, erases);
+        uint32_t n = it->second;
+        map_.erase(it);
+        uint32_t children = _take_children(n);
+        if (n == root_) {
+            root_ = children;
+        } else {
+            _cut(n);
+            root_ = _merge(root_, children);
+        }
+        nodes_[n].live = false;
+        free_.push_back(n);
+        return std::move(nodes_[n].data);
+    }
+
+    const HeapOpCounts& ops() const {
+        return ops_;
+    }
+
+    class ConstIterator {
+    public:
+        ConstIterator(const PairingHeapMap& heap, size_t index) : heap_(heap), index_(index) { _skip(); }
+
+        const pair<K, V>& operator*() const {
+            return heap_.nodes_[index_].data;
+        }
+
+        const pair<K, V>* operator->() const {
+            return &heap_.nodes_[index_].data;
+        }
+
+        ConstIterator& operator++() {
+            ++index_;
+            _skip();
+            return *this;
+        }
+
+        bool operator==(const ConstIterator& other) const {
+            return index_ == other.index_;
+        }
+
+        bool operator!=(const ConstIterator& other) const {
+            return index_ != other.index_;
+        }
+
+    private:
+        const PairingHeapMap& heap_;
+        size_t index_;
+
+        void _skip() {
+            while (index_ < heap_.nodes_.size() && !heap_.nodes_[index_].live) ++index_;
+        }
+    };
+
+    ConstIterator begin() const {
+        return ConstIterator(*this, 0);
+    }
+
+    ConstIterator end() const {
+        return ConstIterator(*this, nodes_.size());
     }
 };
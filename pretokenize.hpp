@@ -0,0 +1,166 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "bpe_decoder.hpp"
+#include "bpe_types.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PRETOKENIZE_X86
+#endif
+
+using namespace std;
+
+// Optional pre-tokenization: the input is cut into segments that no merge may
+// cross, so the trainer never spends rules (or pair table entries) on pairs
+// like "e " or ".\r", and segments can be encoded independently. A segment is
+// a maximal run of one byte class:
+//
+//   letters      A-Z, a-z, and every byte >= 0x80 so UTF-8 sequences stay whole
+//   digits       0-9
+//   whitespace   space, \t \n \v \f \r
+//   other        punctuation and control bytes
+//
+// except that the single space directly before a letter run belongs to it
+// (" the"), and the rest of a whitespace run before that space stays a
+// segment of its own ("\n\n" " the"). Boundaries come back as a bitmap with
+// bit i set when byte i starts a segment. The scan classifies 32 bytes at a
+// time with AVX2 when the CPU has it, 16 with SSE2 otherwise, and finishes
+// the tail one byte at a time.
+
+enum ByteClass : uint8_t {
+    BYTE_OTHER = 0,
+    BYTE_LETTER = 1,
+    BYTE_DIGIT = 2,
+    BYTE_SPACE = 3,
+};
+
+inline uint8_t byte_class(unsigned char b) {
+    if (b >= 0x80 || (unsigned char)((b | 0x20) - 'a') < 26) return BYTE_LETTER;
+    if ((unsigned char)(b - '0') < 10) return BYTE_DIGIT;
+    if (b == ' ' || (unsigned char)(b - '\t') < 5) return BYTE_SPACE;
+    return BYTE_OTHER;
+}
+
+// whether data[i] starts a segment, for 0 < i < size
+inline bool segment_boundary(const unsigned char* data, size_t size, size_t i) {
+    uint8_t c = byte_class(data[i]);
+    if (c != byte_class(data[i - 1])) return !(data[i - 1] == ' ' && c == BYTE_LETTER);
+    return data[i] == ' ' && i + 1 < size && byte_class(data[i + 1]) == BYTE_LETTER;
+}
+
+inline bool segment_start(const vector<uint64_t>& starts, size_t i) {
+    return (starts[i >> 6] >> (i & 63)) & 1;
+}
+
+// ors a mask of width bits into bitmap at bit offset i
+inline void _or_bits(uint64_t* bitmap, size_t i, uint64_t mask, unsigned width) {
+    size_t word = i >> 6;
+    unsigned offset = i & 63;
+    bitmap[word] |= mask << offset;
+    if (offset > 64 - width) bitmap[word + 1] |= mask >> (64 - offset);
+}
+
+#ifdef PRETOKENIZE_X86
+// unsigned x < n, as min(x, n - 1) == x
+inline __m128i _below_sse2(__m128i x, char n) {
+    return _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(n - 1)), x);
+}
+
+inline __m128i _classify_sse2(__m128i b) {
+    __m128i letter = _mm_or_si128(_below_sse2(_mm_sub_epi8(_mm_or_si128(b, _mm_set1_epi8(0x20)), _mm_set1_epi8('a')), 26),
+        _mm_cmplt_epi8(b, _mm_setzero_si128()));
+    __m128i digit = _below_sse2(_mm_sub_epi8(b, _mm_set1_epi8('0')), 10);
+    __m128i space = _mm_or_si128(_mm_cmpeq_epi8(b, _mm_set1_epi8(' ')), _below_sse2(_mm_sub_epi8(b, _mm_set1_epi8('\t')), 5));
+    return _mm_or_si128(_mm_or_si128(_mm_and_si128(letter, _mm_set1_epi8(BYTE_LETTER)),
+        _mm_and_si128(digit, _mm_set1_epi8(BYTE_DIGIT))), _mm_and_si128(space, _mm_set1_epi8(BYTE_SPACE)));
+}
+
+// scans from byte i while 17 bytes remain (the block and the byte after it)
+// and returns where it stopped
+inline size_t _segment_starts_sse2(const unsigned char* data, size_t size, size_t i, uint64_t* bitmap) {
+    const __m128i space = _mm_set1_epi8(' '), letter = _mm_set1_epi8(BYTE_LETTER);
+    for (; i + 16 < size; i += 16) {
+        __m128i cur = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i prev = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i - 1));
+        __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 1));
+        __m128i cls = _classify_sse2(cur);
+        __m128i same = _mm_cmpeq_epi8(cls, _classify_sse2(prev));
+        uint32_t join = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(prev, space), _mm_cmpeq_epi8(cls, letter)));
+        // a space that leaves the whitespace run before it to join the word after it
+        uint32_t split = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(same, _mm_cmpeq_epi8(cur, space)),
+            _mm_cmpeq_epi8(_classify_sse2(next), letter)));
+        uint64_t mask = (~(_mm_movemask_epi8(same) | join) | split) & 0xffff;
+        if (mask) _or_bits(bitmap, i, mask, 16);
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) inline __m256i _below_avx2(__m256i x, char n) {
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(n - 1)), x);
+}
+
+__attribute__((target("avx2"))) inline __m256i _classify_avx2(__m256i b) {
+    __m256i letter = _mm256_or_si256(
+        _below_avx2(_mm256_sub_epi8(_mm256_or_si256(b, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a')), 26),
+        _mm256_cmpgt_epi8(_mm256_setzero_si256(), b));
+    __m256i digit = _below_avx2(_mm256_sub_epi8(b, _mm256_set1_epi8('0')), 10);
+    __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(b, _mm256_set1_epi8(' ')),
+        _below_avx2(_mm256_sub_epi8(b, _mm256_set1_epi8('\t')), 5));
+    return _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(letter, _mm256_set1_epi8(BYTE_LETTER)),
+        _mm256_and_si256(digit, _mm256_set1_epi8(BYTE_DIGIT))), _mm256_and_si256(space, _mm256_set1_epi8(BYTE_SPACE)));
+}
+
+__attribute__((target("avx2"))) inline size_t _segment_starts_avx2(const unsigned char* data, size_t size, size_t i, uint64_t* bitmap) {
+    const __m256i space = _mm256_set1_epi8(' '), letter = _mm256_set1_epi8(BYTE_LETTER);
+    for (; i + 32 < size; i += 32) {
+        __m256i cur = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i prev = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i - 1));
+        __m256i next = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 1));
+        __m256i cls = _classify_avx2(cur);
+        __m256i same = _mm256_cmpeq_epi8(cls, _classify_avx2(prev));
+        uint32_t join = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(prev, space), _mm256_cmpeq_epi8(cls, letter)));
+        uint32_t split = _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(same, _mm256_cmpeq_epi8(cur, space)),
+            _mm256_cmpeq_epi8(_classify_avx2(next), letter)));
+        uint64_t mask = (~((uint32_t)_mm256_movemask_epi8(same) | join) | split) & 0xffffffffull;
+        if (mask) _or_bits(bitmap, i, mask, 32);
+    }
+    return i;
+}
+#endif
+
+// Fills starts with the segment start bitmap of data (one bit per byte).
+inline void segment_starts(const unsigned char* data, size_t size, vector<uint64_t>& starts) {
+    starts.assign(size / 64 + 2, 0); // one spare word for the spill in _or_bits
+    if (size == 0) return;
+    starts[0] = 1;
+    size_t i = 1;
+#ifdef PRETOKENIZE_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) i = _segment_starts_avx2(data, size, i, starts.data());
+    i = _segment_starts_sse2(data, size, i, starts.data());
+#endif
+    for (; i < size; i++) {
+        if (segment_boundary(data, size, i)) starts[i >> 6] |= 1ull << (i & 63);
+    }
+}
+
+// Segment starts of an already encoded token stream, one bit per token: a
+// token starts a segment when its first byte does. Tokens produced under
+// segmentation never span a boundary, so this recovers the bitmap of a
+// checkpoint or a model's stored tokens.
+inline void token_segment_starts(const vector<Token>& tokens, const vector<Pair>& grammar, vector<uint64_t>& starts) {
+    BPE_Decoder decoder(grammar);
+    ByteBuffer bytes;
+    decoder.decode(tokens.data(), tokens.size(), bytes);
+    const vector<uint32_t>& length = decoder.table.length;
+    vector<uint64_t> byte_starts;
+    segment_starts(bytes.data(), bytes.size(), byte_starts);
+    starts.assign(tokens.size() / 64 + 2, 0);
+    size_t offset = 0;
+    for (size_t k = 0; k < tokens.size(); k++) {
+        if (segment_start(byte_starts, offset)) starts[k >> 6] |= 1ull << (k & 63);
+        offset += length[tokens[k]];
+    }
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <concepts>
+#include <cstddef>
+#include <utility>
+#include "heap_ops.hpp"
+
+using namespace std;
+
+// What BPE_Encoding needs from its pair frequency table: a map from K to V
+// that can also hand out the entry with the largest key (as computed by the
+// HeapKeyFunc it was constructed with) and be iterated in any order. Every
+// backend (HeapMap, FibHeapMap, PairingHeapMap, BucketQueueMap) models it.
+// update takes any callable on V& as a template parameter, so the trainer's
+// lambdas inline, and returns the updated value.
+template <typename M, typename K, typename V>
+concept PriorityMap = requires(M& m, const M& cm, const K& k, const V& v, void (*f)(V&), size_t n) {
+    m.reserve(n);
+    m.push(k, v);
+    { m.update(k, f) } -> convertible_to<const V&>;
+    { m.view(k) } -> convertible_to<const V&>;
+    { m.pop() } -> same_as<pair<K, V>>;
+    { m.erase(k) } -> same_as<pair<K, V>>;
+    { cm.max() } -> convertible_to<const pair<K, V>&>;
+    { cm.contains(k) } -> convertible_to<bool>;
+    { cm.size() } -> convertible_to<size_t>;
+    { cm.ops() } -> convertible_to<const HeapOpCounts&>;
+    { *cm.begin() } -> convertible_to<const pair<K, V>&>;
+    cm.begin() != cm.end();
+};
+
+// Backends that can also walk their entries from the largest key down, which
+// lets reduce_batch stop after the candidates it needs.
+template <typename M, typename K, typename V>
+concept DescendingPriorityMap = PriorityMap<M, K, V> && requires(const M& cm, bool (*f)(const pair<K, V>&)) {
+    cm.for_each_descending(f);
+};
@@ -0,0 +1,94 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Fixed-size object allocator for node-based containers. Objects are carved
+// out of slabs that double in size (up to MAX_SLAB objects), freed objects go
+// on an intrusive free list and are reused first, and the slabs themselves are
+// only returned when the pool is cleared or destroyed. Neither clear() nor the
+// destructor runs destructors of objects that are still live; owners whose T
+// is not trivially destructible destroy() them first.
+template <typename T>
+class SlabPool {
+private:
+    static constexpr size_t MIN_SLAB = 64;
+    static constexpr size_t MAX_SLAB = 1 << 16;
+
+    union Slot {
+        Slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    vector<unique_ptr<Slot[]>> slabs_;
+    Slot* free_;      // singly linked through Slot::next
+    size_t used_;     // slots handed out of the newest slab
+    size_t capacity_; // slots in the newest slab
+    size_t live_;
+
+    // starts a new slab of n slots; what is left of the current one goes on
+    // the free list so it is not abandoned
+    void _grow(size_t n) {
+        while (used_ < capacity_) {
+            Slot* slot = &slabs_.back()[used_++];
+            slot->next = free_;
+            free_ = slot;
+        }
+        slabs_.emplace_back(new Slot[n]);
+        used_ = 0;
+        capacity_ = n;
+    }
+
+public:
+    SlabPool() : free_(nullptr), used_(0), capacity_(0), live_(0) {}
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    // makes room for n more objects without another allocation
+    void reserve(size_t n) {
+        size_t available = capacity_ - used_;
+        for (Slot* s = free_; s && available < n; s = s->next) available++;
+        if (available < n) _grow(n - available);
+    }
+
+    template <typename... Args>
+    T* create(Args&&... args) {
+        Slot* slot;
+        if (free_) {
+            slot = free_;
+            free_ = free_->next;
+        } else {
+            if (used_ == capacity_) _grow(min(max(capacity_ * 2, MIN_SLAB), MAX_SLAB));
+            slot = &slabs_.back()[used_++];
+        }
+        live_++;
+        return new (slot->storage) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T* p) {
+        if (!p) return;
+        p->~T();
+        Slot* slot = reinterpret_cast<Slot*>(p);
+        slot->next = free_;
+        free_ = slot;
+        live_--;
+    }
+
+    // objects currently handed out
+    size_t live() const {
+        return live_;
+    }
+
+    // returns every slab at once
+    void clear() {
+        slabs_.clear();
+        free_ = nullptr;
+        used_ = capacity_ = live_ = 0;
+    }
+};
@@ -0,0 +1,211 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "bpe_types.hpp"
+#include "heap_map.hpp"
+#include "bpe_format.hpp"
+
+using namespace std;
+
+#define STREAM_MAX_WORD 256 // longer runs are cut, which bounds memory per word
+
+struct WordPairKey {
+    size_t operator()(const pair<Pair, uint64_t>& p) const {
+        return p.second;
+    }
+};
+
+// Trainer for corpora that do not fit in memory. The input is read in fixed
+// size chunks and cut into words (a run of whitespace followed by a run of
+// anything else). Only the distinct words are kept, with a multiplicity, and
+// pair counts are weighted by it, so a merge costs time proportional to the
+// unique words it touches rather than to the corpus. Merges never cross a
+// word boundary.
+class StreamingBPE {
+private:
+    unordered_map<string, uint64_t> word_counts_;
+    string carry_; // unfinished word at the end of the last chunk
+
+    vector<vector<Token>> words_;
+    vector<uint64_t> mult_;
+    HeapMap<Pair, uint64_t, PairHash, WordPairKey> freqs_;
+    unordered_map<Pair, unordered_set<uint32_t>, PairHash> where_; // words that contain each pair
+
+    static bool is_space(unsigned char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    void _add_word(const string& word) {
+        word_counts_[word]++;
+        total_bytes += word.size();
+    }
+
+    // adds (sign > 0) or removes (sign < 0) every pair of word w
+    void _count_word(uint32_t w, int sign) {
+        const vector<Token>& word = words_[w];
+        for (size_t i = 0; i + 1 < word.size(); i++) {
+            Pair pair = {word[i], word[i + 1]};
+            if (sign > 0) {
+                if (!freqs_.contains(pair)) freqs_.push(pair, mult_[w]);
+                else freqs_.update(pair, [&](uint64_t& count) { count += mult_[w]; });
+                where_[pair].insert(w);
+            } else {
+                if (freqs_.update(pair, [&](uint64_t& count) { count -= mult_[w]; }) == 0) {
+                    freqs_.erase(pair);
+                    where_.erase(pair);
+                }
+            }
+        }
+    }
+
+public:
+    vector<Pair> grammar;
+    size_t chunk_size;
+    size_t total_bytes;
+    size_t iterations;
+    Pair most_freq_pair;
+    uint64_t highest_freq;
+    chrono::time_point<chrono::system_clock> start;
+
+    StreamingBPE(size_t chunk_size = 1 << 20) : freqs_(WordPairKey()), chunk_size(chunk_size),
+            total_bytes(0), iterations(0), most_freq_pair{0, 0}, highest_freq(0) {
+        start = chrono::system_clock::now();
+        for (Token i = 0; i < 256; i++) {
+            grammar.push_back(Pair{i, 0});
+        }
+    }
+
+    // feeds one more chunk of the corpus; a word may span several calls
+    void add_chunk(const char* data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            unsigned char c = data[i];
+            bool word_ends = !carry_.empty() && is_space(c) && !is_space(carry_.back());
+            if (word_ends || carry_.size() == STREAM_MAX_WORD) {
+                _add_word(carry_);
+                carry_.clear();
+            }
+            carry_.push_back(c);
+        }
+    }
+
+    void finish_input() {
+        if (!carry_.empty()) _add_word(carry_);
+        carry_.clear();
+    }
+
+    bool add_file(const string& filename) {
+        ifstream file(filename, ios::binary);
+        if (!file) {
+            cerr << "Error opening file: " << filename << endl;
+            return false;
+        }
+        vector<char> buffer(chunk_size);
+        while (file) {
+            file.read(buffer.data(), buffer.size());
+            add_chunk(buffer.data(), file.gcount());
+        }
+        finish_input();
+        return true;
+    }
+
+    size_t unique_words() const {
+        return words_.empty() ? word_counts_.size() : words_.size();
+    }
+
+    // number of tokens the whole corpus would have with the current grammar
+    uint64_t token_length() const {
+        uint64_t length = 0;
+        for (size_t w = 0; w < words_.size(); w++) length += words_[w].size() * mult_[w];
+        return length;
+    }
+
+    // turns the word table into token sequences and counts their pairs
+    void prepare() {
+        vector<pair<string, uint64_t>> sorted(word_counts_.begin(), word_counts_.end());
+        unordered_map<string, uint64_t>().swap(word_counts_);
+        sort(sorted.begin(), sorted.end()); // deterministic word ids
+        for (auto& [word, count] : sorted) {
+            words_.emplace_back(word.begin(), word.end());
+            for (Token& t : words_.back()) t = (unsigned char)t;
+            mult_.push_back(count);
+        }
+        for (uint32_t w = 0; w < words_.size(); w++) _count_word(w, 1);
+    }
+
+    // one merge of the most frequent pair over every word that contains it
+    void reduce() {
+        iterations += 1;
+        if (freqs_.size() == 0) {
+            highest_freq = 0;
+            return;
+        }
+        most_freq_pair = freqs_.max().first;
+        highest_freq = freqs_.max().second;
+        if (highest_freq <= 1) return; // not compressable
+        grammar.push_back(most_freq_pair);
+        Token new_token = grammar.size() - 1;
+
+        vector<uint32_t> touched(where_[most_freq_pair].begin(), where_[most_freq_pair].end());
+        sort(touched.begin(), touched.end());
+        vector<Pair> lost; // pairs around the merge sites, which the word may no longer have
+        for (uint32_t w : touched) {
+            vector<Token>& word = words_[w];
+            _count_word(w, -1);
+            lost.assign(1, most_freq_pair);
+            size_t out = 0;
+            for (size_t i = 0; i < word.size(); i++) {
+                if (i + 1 < word.size() && word[i] == most_freq_pair.l && word[i + 1] == most_freq_pair.r) {
+                    if (i > 0) lost.push_back(Pair{word[i - 1], word[i]});
+                    if (i + 2 < word.size()) lost.push_back(Pair{word[i + 1], word[i + 2]});
+                    word[out++] = new_token;
+                    i++;
+                } else {
+                    word[out++] = word[i];
+                }
+            }
+            word.resize(out);
+            _count_word(w, 1);
+            for (Pair pair : lost) {
+                bool kept = false;
+                for (size_t i = 0; i + 1 < word.size() && !kept; i++) {
+                    kept = word[i] == pair.l && word[i + 1] == pair.r;
+                }
+                auto it = where_.find(pair);
+                if (!kept && it != where_.end()) it->second.erase(w);
+            }
+        }
+    }
+
+    void compress() {
+        prepare();
+        do {
+            reduce();
+        } while (highest_freq > 1);
+    }
+
+    // .bpe file with the grammar only; there is no token stream to store
+    bool serialize(const string& fname) {
+        BPEFile file;
+        file.flags = BPE_FLAG_GRAMMAR_ONLY;
+        file.iterations = iterations;
+        file.grammar = grammar;
+        return write_bpe(fname, file);
+    }
+
+    friend ostream& operator << (ostream& os, const StreamingBPE& bpe) {
+        chrono::duration<double> elapsed_seconds = chrono::system_clock::now() - bpe.start;
+        os << "-------------------------------------------------------------------------------------------------------" << endl;
+        os << "Corpus bytes: " << bpe.total_bytes << " Unique words: " << bpe.unique_words() << " Token Length: " << bpe.token_length()
+            << " Unique tokens: " << bpe.grammar.size() << " Highest freq: " << bpe.highest_freq << " (" << bpe.most_freq_pair.l
+            << ", " << bpe.most_freq_pair.r << ") Freq table size: " << bpe.freqs_.size() << endl;
+        os << "elapsed time: " << elapsed_seconds.count() << "s\n";
+        os << "iteration: " << bpe.iterations << "\n" << endl;
+        return os;
+    }
+};
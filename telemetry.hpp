@@ -0,0 +1,145 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+// Instrumentation for the trainer, in three layers:
+//   TRACE(...)       per-event trace points, compiled in only with -DVERBOSE
+//   TELEMETRY_ADD    counters that are always on (unless -DNO_TELEMETRY) and
+//                    cost a plain add on the hot path
+//   TelemetryReporter  a background thread that samples the counters on a
+//                    timer and writes them out as JSON lines
+
+// #define VERBOSE
+
+#ifdef VERBOSE
+#define TRACE(msg) (cerr << msg << '\n')
+#else
+#define TRACE(msg) ((void)0)
+#endif
+
+// A counter with a single writer that any thread may read. The writer does a
+// relaxed load and store instead of a locked read-modify-write, so counting
+// compiles to an ordinary add; readers see some recent value, never a torn one.
+class TelemetryCounter {
+private:
+    atomic<uint64_t> value_{0};
+
+public:
+    void add(uint64_t n) {
+        value_.store(value_.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+
+    void set(uint64_t n) {
+        value_.store(n, memory_order_relaxed);
+    }
+
+    uint64_t get() const {
+        return value_.load(memory_order_relaxed);
+    }
+};
+
+// Written by the thread that owns the frequency table (the training loop);
+// the parallel workers report through it after they join.
+struct TelemetryCounters {
+    // running totals
+    TelemetryCounter merges;
+    TelemetryCounter pair_incs;
+    TelemetryCounter pair_decs;
+    TelemetryCounter occurrences;   // pair positions visited by apply_merge
+    TelemetryCounter heap_cuts;     // subtrees cut out of a Fibonacci or pairing heap
+    TelemetryCounter consolidations;
+    // current values
+    TelemetryCounter tokens;
+    TelemetryCounter table_size;
+    TelemetryCounter highest_freq;
+};
+
+inline TelemetryCounters telemetry;
+
+#ifdef NO_TELEMETRY
+#define TELEMETRY_ADD(counter, n) ((void)0)
+#define TELEMETRY_SET(counter, n) ((void)0)
+#else
+#define TELEMETRY_ADD(counter, n) (telemetry.counter.add(n))
+#define TELEMETRY_SET(counter, n) (telemetry.counter.set(n))
+#endif
+
+// Samples telemetry every interval and writes one JSON object per line to out,
+// with the totals, their rates since the previous sample, and the current
+// values. A last sample is written when the reporter stops, so short runs
+// still produce a line.
+class TelemetryReporter {
+private:
+    ostream& out_;
+    chrono::milliseconds interval_;
+    chrono::steady_clock::time_point start_;
+    mutex mutex_;
+    condition_variable wake_;
+    bool stopping_;
+    thread thread_;
+
+    struct Sample {
+        double seconds;
+        uint64_t merges, pair_incs, pair_decs, occurrences, heap_cuts, consolidations;
+    };
+
+    Sample _take() const {
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start_;
+        return Sample{elapsed.count(), telemetry.merges.get(), telemetry.pair_incs.get(), telemetry.pair_decs.get(),
+            telemetry.occurrences.get(), telemetry.heap_cuts.get(), telemetry.consolidations.get()};
+    }
+
+    void _write(const Sample& s, const Sample& prev) {
+        double dt = s.seconds - prev.seconds;
+        auto rate = [dt](uint64_t now, uint64_t before) { return dt > 0 ? (now - before) / dt : 0.0; };
+        out_ << "{\"t\":" << s.seconds
+            << ",\"merges\":" << s.merges << ",\"merges_per_s\":" << rate(s.merges, prev.merges)
+            << ",\"pair_incs\":" << s.pair_incs << ",\"pair_incs_per_s\":" << rate(s.pair_incs, prev.pair_incs)
+            << ",\"pair_decs\":" << s.pair_decs << ",\"pair_decs_per_s\":" << rate(s.pair_decs, prev.pair_decs)
+            << ",\"occurrences\":" << s.occurrences << ",\"occurrences_per_s\":" << rate(s.occurrences, prev.occurrences)
+            << ",\"heap_cuts\":" << s.heap_cuts << ",\"consolidations\":" << s.consolidations
+            << ",\"tokens\":" << telemetry.tokens.get() << ",\"table_size\":" << telemetry.table_size.get()
+            << ",\"highest_freq\":" << telemetry.highest_freq.get() << "}\n";
+        out_.flush();
+    }
+
+    void _run() {
+        Sample prev = _take();
+        unique_lock<mutex> lock(mutex_);
+        while (true) {
+            bool stop = wake_.wait_for(lock, interval_, [this] { return stopping_; });
+            Sample s = _take();
+            _write(s, prev);
+            prev = s;
+            if (stop) return;
+        }
+    }
+
+public:
+    TelemetryReporter(ostream& out, chrono::milliseconds interval)
+        : out_(out), interval_(interval), start_(chrono::steady_clock::now()), stopping_(false),
+          thread_(&TelemetryReporter::_run, this) {}
+
+    TelemetryReporter(const TelemetryReporter&) = delete;
+    TelemetryReporter& operator=(const TelemetryReporter&) = delete;
+
+    ~TelemetryReporter() {
+        stop();
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        if (thread_.joinable()) thread_.join();
+    }
+};
@@ -0,0 +1,223 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "bpe_types.hpp"
+#include "bpe_encoder.hpp"
+#include "bpe_decoder.hpp"
+#include "bpe_format.hpp"
+#include "expansion_table.hpp"
+#include "mapped_file.hpp"
+
+using namespace std;
+
+// Read-only tokenizer artifact that is used straight out of mmap: loading
+// checks the header and hands out pointers into the mapping, so startup does
+// not depend on the vocabulary size. Every section is at a fixed offset from
+// the start of the file and holds no pointers:
+//
+//   VocabHeader
+//   Pair     grammar[grammar_size]
+//   RankSlot slots[1 << slot_bits]     open addressing, linear probing
+//   uint64_t offset[grammar_size]      expansion of token t is
+//   uint32_t length[grammar_size]      bytes[offset[t] .. offset[t] + length[t])
+//   uint64_t junctions[JUNCTION_WORDS] see rule_junctions
+//   uint8_t  bytes[bytes_size]
+//
+// Sections start on 8-byte boundaries. The slot of a pair is found from
+// mix64 of its two ids, and the table is kept at most half full. Only the
+// header is validated on load, so that startup stays independent of the
+// vocabulary; the sections are checked as they are used instead. A probe
+// never visits more than max_probe slots and ignores ranks outside the grammar,
+// and an expansion outside bytes is an error, so a damaged image can give
+// wrong tokens but is never read out of bounds. flags
+// carries BPE_FLAG_SEGMENTED over from the model, and encode() pre-tokenizes
+// when it is set.
+
+struct VocabHeader {
+    char magic[8];          // "bpevoc2\0"
+    uint32_t grammar_size;
+    uint32_t slot_bits;
+    uint32_t flags;         // BPE_FLAG_SEGMENTED or 0
+    uint32_t max_probe;     // most slots any lookup in the table visits
+    uint64_t grammar_offset;
+    uint64_t slots_offset;
+    uint64_t offset_offset;
+    uint64_t length_offset;
+    uint64_t junctions_offset;
+    uint64_t bytes_offset;
+    uint64_t bytes_size;
+    uint64_t file_size;
+};
+static_assert(sizeof(VocabHeader) == 88, "VocabHeader must not have padding");
+
+struct RankSlot {
+    Pair pair;
+    Token rank; // NO_RANK when the slot is empty
+};
+
+inline uint64_t vocab_slot(Pair pair, uint32_t slot_bits) {
+    return mix64((uint64_t)pair.l << 32 | pair.r) & ((1ull << slot_bits) - 1);
+}
+
+inline uint64_t _vocab_align(uint64_t pos) {
+    return (pos + 7) & ~7ull;
+}
+
+// section offsets for a grammar; a loaded header must match this exactly
+inline VocabHeader _vocab_layout(uint32_t grammar_size, uint64_t bytes_size, uint32_t flags) {
+    VocabHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "bpevoc2", 8);
+    header.grammar_size = grammar_size;
+    header.flags = flags & BPE_FLAG_SEGMENTED;
+    header.slot_bits = 1;
+    while ((1ull << header.slot_bits) < 2ull * grammar_size) header.slot_bits++;
+    header.grammar_offset = sizeof(VocabHeader);
+    header.slots_offset = _vocab_align(header.grammar_offset + (uint64_t)grammar_size * sizeof(Pair));
+    header.offset_offset = _vocab_align(header.slots_offset + (sizeof(RankSlot) << header.slot_bits));
+    header.length_offset = _vocab_align(header.offset_offset + (uint64_t)grammar_size * sizeof(uint64_t));
+    header.junctions_offset = _vocab_align(header.length_offset + (uint64_t)grammar_size * sizeof(uint32_t));
+    header.bytes_offset = header.junctions_offset + JUNCTION_WORDS * sizeof(uint64_t);
+    header.bytes_size = bytes_size;
+    header.file_size = header.bytes_offset + bytes_size;
+    return header;
+}
+
+inline bool write_vocab(const string& fname, const vector<Pair>& grammar, uint32_t flags = 0) {
+    ExpansionTable expansions(grammar);
+    VocabHeader header = _vocab_layout(grammar.size(), expansions.bytes.size(), flags);
+
+    vector<uint8_t> image(header.file_size, 0);
+    memcpy(image.data() + header.grammar_offset, grammar.data(), grammar.size() * sizeof(Pair));
+    RankSlot* slots = reinterpret_cast<RankSlot*>(image.data() + header.slots_offset);
+    uint64_t mask = (1ull << header.slot_bits) - 1;
+    for (uint64_t s = 0; s <= mask; s++) {
+        slots[s] = RankSlot{Pair{0, 0}, BPE_Encoder::NO_RANK};
+    }
+    for (Token i = 256; i < grammar.size(); i++) {
+        uint64_t s = vocab_slot(grammar[i], header.slot_bits);
+        while (slots[s].rank != BPE_Encoder::NO_RANK && !(slots[s].pair == grammar[i])) s = (s + 1) & mask;
+        if (slots[s].rank == BPE_Encoder::NO_RANK) slots[s] = RankSlot{grammar[i], i}; // first rule wins, like BPE_Encoder
+    }
+    // a lookup stops at the first empty slot, so the longest one runs from the
+    // start of the longest cluster to the empty slot after it
+    uint32_t max_probe = 1, run = 0;
+    for (uint64_t k = 0; k <= 2 * mask + 1; k++) {
+        run = slots[k & mask].rank == BPE_Encoder::NO_RANK ? 0 : run + 1;
+        max_probe = max(max_probe, min<uint32_t>(run, mask) + 1);
+    }
+    header.max_probe = max_probe;
+    memcpy(image.data(), &header, sizeof(header));
+    memcpy(image.data() + header.offset_offset, expansions.offset.data(), grammar.size() * sizeof(uint64_t));
+    memcpy(image.data() + header.length_offset, expansions.length.data(), grammar.size() * sizeof(uint32_t));
+    vector<uint64_t> junctions;
+    rule_junctions(grammar.data(), grammar.size(), junctions);
+    memcpy(image.data() + header.junctions_offset, junctions.data(), JUNCTION_WORDS * sizeof(uint64_t));
+    memcpy(image.data() + header.bytes_offset, expansions.bytes.data(), expansions.bytes.size());
+
+    ofstream file(fname, ios::binary);
+    if (!file) {
+        cerr << "Error opening file: " << fname << endl;
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(image.data()), image.size());
+    if (!file) {
+        cerr << "Error writing file: " << fname << endl;
+        return false;
+    }
+    return true;
+}
+
+class VocabImage {
+private:
+    MappedFile file_;
+    const VocabHeader* header_;
+    const Pair* grammar_;
+    const RankSlot* slots_;
+    const uint64_t* offset_;
+    const uint32_t* length_;
+    const uint64_t* junctions_; // see rule_junctions
+    const uint8_t* bytes_;
+    uint64_t mask_;
+
+    void _check(Token t) const {
+        if (t >= header_->grammar_size || offset_[t] > header_->bytes_size
+                || length_[t] > header_->bytes_size - offset_[t]) {
+            throw out_of_range("Token has no expansion in the vocab image");
+        }
+    }
+
+public:
+    static constexpr Token NO_RANK = BPE_Encoder::NO_RANK;
+
+    // Maps fname and checks that the sections fit the file. The pages are only
+    // touched on first use. On failure the error is printed and ok() is false.
+    explicit VocabImage(const string& fname) : file_(fname, MADV_RANDOM), header_(nullptr) {
+        if (!file_.data()) return;
+        const VocabHeader* header = reinterpret_cast<const VocabHeader*>(file_.data());
+        if (file_.size() < sizeof(VocabHeader) || memcmp(header->magic, "bpevoc2", 8) != 0) {
+            cerr << "Unsupported vocab file: " << fname << endl;
+            return;
+        }
+        VocabHeader expected = _vocab_layout(header->grammar_size, header->bytes_size, header->flags);
+        expected.max_probe = header->max_probe;
+        if (memcmp(header, &expected, sizeof(expected)) != 0 || header->file_size != file_.size()
+                || header->max_probe == 0 || header->max_probe > (1ull << header->slot_bits)) {
+            cerr << "Corrupt header in " << fname << endl;
+            return;
+        }
+        header_ = header;
+        grammar_ = reinterpret_cast<const Pair*>(file_.data() + header->grammar_offset);
+        slots_ = reinterpret_cast<const RankSlot*>(file_.data() + header->slots_offset);
+        offset_ = reinterpret_cast<const uint64_t*>(file_.data() + header->offset_offset);
+        length_ = reinterpret_cast<const uint32_t*>(file_.data() + header->length_offset);
+        junctions_ = reinterpret_cast<const uint64_t*>(file_.data() + header->junctions_offset);
+        bytes_ = file_.data() + header->bytes_offset;
+        mask_ = (1ull << header->slot_bits) - 1;
+    }
+
+    bool ok() const {
+        return header_ != nullptr;
+    }
+
+    size_t size() const {
+        return header_->grammar_size;
+    }
+
+    const Pair* grammar() const {
+        return grammar_;
+    }
+
+    Token rank(Pair pair) const {
+        uint64_t s = vocab_slot(pair, header_->slot_bits);
+        for (uint32_t probes = 0; probes < header_->max_probe; probes++, s = (s + 1) & mask_) {
+            if (slots_[s].rank == NO_RANK) return NO_RANK;
+            if (slots_[s].pair == pair) return slots_[s].rank < header_->grammar_size ? slots_[s].rank : NO_RANK;
+        }
+        return NO_RANK; // only reached in a damaged table
+    }
+
+    uint32_t length(Token t) const {
+        _check(t);
+        return length_[t];
+    }
+
+    const uint8_t* data(Token t) const {
+        _check(t);
+        return bytes_ + offset_[t];
+    }
+
+    void encode(const unsigned char* data, size_t size, vector<Token>& out) const {
+        encode_pieces(*this, junctions_, data, size, out, header_->flags & BPE_FLAG_SEGMENTED, 1);
+    }
+
+    // decoder over the mapped expansions; must not outlive the image
+    BPE_Decoder decoder() const {
+        return BPE_Decoder(offset_, length_, bytes_, header_->bytes_size, header_->grammar_size);
+    }
+};